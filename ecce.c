@@ -22,6 +22,28 @@
    to pass the ecce command as a parameter while avoiding
    problems such as the use of " characters in the ecce command.
 
+   The O<n> command (to just before character n, counting from 1 as
+   Emacs does) and -cursor-file, which says where the cursor ended
+   up, let Emacs hand over and take back its point directly, rather
+   than by walking there with (r,m) and searching for a marker.
+
+   -diff makes %C write a patch in place of the whole text, so the
+   snippet below only has to send the buffer one way.  With -server,
+   one ecce stays up for the buffer and is sent each
+   command over a pipe, answering with only the part of the text that
+   changed (see serve() for the protocol), so a command no longer costs
+   a process and two copies of the whole buffer.  The second snippet
+   below uses it in place of the first.
+
+   -batch lista runs the -command on every file named in lista, one
+   name to a line ("-" reads the names from stdin), writing each back
+   in place, and -jobs n does n files at a time (the default is one
+   per processor).  On Linux that needs threads, so if your C library
+   keeps them apart compile with: cc -o ecce -DWANT_UTF8 ecce.c -pthread
+   -jobs also lets a line-at-a-time loop such as (F1/x/S/y/,M)0 take a
+   big file a piece per thread (see run_lines()), and a find with a
+   long way to go look in several places at once (see search_far()).
+
 
 *SYS*
 Add this to your ~/.emacs file (or some equivalent for Windows):
@@ -48,26 +70,93 @@ Add this to your ~/.emacs file (or some equivalent for Windows):
 
 (defun e (ecce_command)
   (interactive "sEcce> ")
-  (let (oldpoint (point))
-    (setq oldpoint (point))
+  (let ((curfile (expand-file-name "~/.ecce-emacs.cur"))
+        (patch (generate-new-buffer " *ecce*"))
+        (coding-system-for-read 'binary)
+        head text)
     (call-process-region (point-min) (point-max)
                          "/bin/bash"
-                         t t nil
+                         nil patch nil
                          "-c"
-                         (concat "ecce - - -hex-command "
-                                 (concat (encode-hex-string (concat (concat (format "(r,m)%d(l,m-r0)?\n" (point)) ecce_command)
-                                                                    (format "\ni/%%EMACS%dCURSOR%%/\n%%c" (+ 495620 oldpoint))
-                                                                    )
-                         ) " 2> ~/.ecce-emacs.err"))
-    )
-    (goto-char (point-min))
-    (search-forward (format "%%EMACS%dCURSOR%%" (+ 495620 oldpoint)))
-    (replace-match "" nil nil)
+                         (concat "ecce - - -diff -cursor-file " curfile " -hex-command "
+                                 (encode-hex-string (concat (format "O%d\n" (point))
+                                                            ecce_command
+                                                            "\n%c"))
+                                 " 2> ~/.ecce-emacs.err"))
+    (with-current-buffer patch   ; "offset deleted inserted", then the new bytes
+      (goto-char (point-min))
+      (setq head (mapcar #'string-to-number (split-string (buffer-substring (point) (line-end-position)))))
+      (when head
+        (forward-line 1)
+        (setq text (decode-coding-string (buffer-substring (point) (+ (point) (nth 2 head))) 'utf-8))))
+    (kill-buffer patch)
+    (when head
+      (let ((from (byte-to-position (1+ (nth 0 head))))
+            (to (byte-to-position (+ 1 (nth 0 head) (nth 1 head)))))
+        (delete-region from to)
+        (goto-char from)
+        (insert text)))
+    (goto-char (with-temp-buffer
+                 (insert-file-contents curfile)
+                 (string-to-number (buffer-string))))
   )
 )
 
 (global-set-key "\C-e" 'e)
 
+;; Or, with one ecce kept running for each buffer:
+
+(defvar-local ecce-process nil)
+(defvar-local ecce-version 0)
+(defvar-local ecce-tick nil)
+
+(defun ecce-request (verb payload)
+  "Send VERB with PAYLOAD, a unibyte string, to this buffer's ecce.
+Returns (VERSION POINT FROM TO OUTPUT NEW-TEXT), offsets in bytes."
+  (let ((proc ecce-process) (version ecce-version) fields)
+    (with-current-buffer (process-buffer proc)
+      (erase-buffer)
+      (process-send-string proc (format "%s %d %d\n%s" verb (length payload) version payload))
+      (while (progn (goto-char (point-min))
+                    (not (and (search-forward "\n" nil t)
+                              (setq fields (split-string (buffer-substring (point-min) (1- (point)))))
+                              (or (not (equal (car fields) "="))
+                                  (>= (- (point-max) (point))
+                                      (+ (string-to-number (nth 3 fields))
+                                         (string-to-number (nth 6 fields))))))))
+        (unless (process-live-p proc) (error "ecce has gone"))
+        (accept-process-output proc 1))
+      (unless (equal (car fields) "=")
+        (error "ecce: %s" (mapconcat #'identity fields " ")))
+      (let* ((n (mapcar #'string-to-number (cdr fields)))
+             (out (+ (point) (nth 2 n))))
+        (list (nth 0 n) (nth 1 n) (nth 3 n) (nth 4 n)
+              (buffer-substring (point) out) (buffer-substring out (point-max)))))))
+
+(defun e (ecce_command)
+  (interactive "sEcce> ")
+  (unless (process-live-p ecce-process)
+    (setq ecce-process (make-process :name "ecce" :buffer (generate-new-buffer " *ecce*")
+                                     :command '("ecce" "/dev/null" "-server")
+                                     :coding 'binary :noquery t)
+          ecce-version 0
+          ecce-tick nil)
+    (with-current-buffer (process-buffer ecce-process) (set-buffer-multibyte nil)))
+  (unless (eql ecce-tick (buffer-chars-modified-tick))   ; changed here: send it all
+    (setq ecce-version (car (ecce-request "t" (encode-coding-string (buffer-string) 'utf-8)))))
+  (let* ((r (ecce-request "c" (encode-coding-string (format "O%d\n%s" (point) ecce_command) 'utf-8)))
+         (from (byte-to-position (1+ (nth 2 r))))
+         (to (byte-to-position (1+ (nth 3 r)))))
+    (setq ecce-version (nth 0 r))
+    (unless (and (= from to) (equal (nth 5 r) ""))
+      (save-excursion
+        (delete-region from to)
+        (goto-char from)
+        (insert (decode-coding-string (nth 5 r) 'utf-8))))
+    (goto-char (byte-to-position (1+ (nth 1 r))))
+    (setq ecce-tick (buffer-chars-modified-tick))
+    (message "%s" (decode-coding-string (nth 4 r) 'utf-8))))
+
  */
 
 #define VERSION "V2.10b" /* %V */
@@ -80,21 +169,49 @@ Add this to your ~/.emacs file (or some equivalent for Windows):
 #include <ctype.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#include <setjmp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)   /*SYS*/
+#define HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define MAP_ALIGN (64*1024)   /* a multiple of any page size we're likely to meet */
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define HAVE_THREADS   /* for -jobs: add -pthread if your C library keeps them apart */
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #ifdef WANT_UTF8
 /* EXPERIMENTAL SUPPORT FOR UTF-8 - been tested for a few years now, seems robust enough to make default. */
+/* The edit buffer holds the UTF-8 bytes themselves rather than one wchar_t per
+   character, which is a quarter of the memory and means files are loaded and
+   saved without decoding or encoding.  The cursor moves a whole character at
+   a time by stepping over continuation bytes (is_cont). */
 #include <wchar.h>
+#include <wctype.h>
 #include <locale.h>
-
-typedef wint_t ecce_int;
-typedef wchar_t ecce_char;
+#define is_cont(c) (((c) & 0xC0) == 0x80)  /* UTF-8 continuation byte */
 #else
+#define is_cont(c) (0!=0)
+#endif
 typedef int ecce_int;
 typedef char ecce_char;
 #define fputwc(x,f) fputc(x,f)
 #define fgetwc(f) fgetc(f)
+#undef WEOF
 #define WEOF EOF
-#endif
 /**************************************************/
 /*                                                */
 /*                                                */
@@ -149,9 +266,11 @@ typedef char ecce_char;
 #define CONTEXT_OFFSET (strlen(NOTE_FILE)-1)
               /* Index of variable part in name above (i.e. of '0')         */
 
+#ifdef ECCE_LIBRARY
+static char *ProgName = "ecce";   /* there is no main() to set it */
+#else
 static char *ProgName = NULL;
-static char *parameter[4] = {NULL, NULL, NULL, NULL}; /* parameters - from, to, log, command */
-static char *commandp = NULL;
+#endif
 
 #define    F       0  /* FROM */
 #define    T       1  /* TO */
@@ -160,19 +279,21 @@ static char *commandp = NULL;
 
 unsigned long estimate_buffer_size(char *fname)
 {
-  FILE *tmp = fopen(fname, "rw");
+  FILE *tmp = fopen(fname, "rb");
   unsigned long maxbuf = 0UL;
   long rc;
 
   /* since we allocate RAM for the whole file, don't bother handling
-     files longer than 32 bits.  It's just a text editor after all... */
+     files longer than 32 bits.  It's just a text editor after all...
+     The buffer grows on demand now (see make_room), so all we need
+     is the file itself plus some elbow room for the edit. */
 
   if (tmp == NULL) return 2UL*1024UL*1024UL;
   (void)fseek(tmp, 0L, SEEK_END);
   rc = ftell(tmp);
   if ((rc < 0) || ferror(tmp)) maxbuf = 0UL; else maxbuf = (unsigned long)rc;
   (void)fclose(tmp);
-  return (maxbuf + 1024UL*256UL) * 3UL;
+  return maxbuf + 1024UL*256UL;
 }
 
 /**************************************************************************/
@@ -191,8 +312,8 @@ typedef ecce_char *cindex;
 #define    bell            7
 #define    nul             0
 #define    del             127
-/* The casebit logic only works on 8-bit characters.  Will need to
-   rewrite case handling if/when we move to UTF 32-bit encoding */
+/* The casebit logic only works on ASCII.  Case outside it is handled
+   by select_case() and friends */
 #define    casebit         ('a'-'A')
 #define    minusbit        casebit
 #define    plusbit         0x80
@@ -226,9 +347,13 @@ typedef ecce_char *cindex;
 #define    star            8
 #define    termin          15
 
-void init_globals (void); 
+static bool new_session (void);
+static void end_session (void);
+bool init_globals (void); 
 void free_buffers (void); 
-void local_echo (ecce_int *sym);        /* Later, make this a char fn. */
+bool make_room (unsigned long needed);
+void trim_buffer (void);
+void local_echo (ecce_int *got);        /* Later, make this a char fn. */
 void read_sym (void); 
 bool fail_with (char *mess, ecce_int culprit); 
 void percent (ecce_int Command_sym); 
@@ -241,9 +366,70 @@ void Scan_text(void);
 void Scan_repeat (void); 
 bool analyse (void); 
 void load_file (void); 
+static bool write_text (FILE *f, cindex from, cindex to);
+static void stream_lines (long lines);
+static void stream_to_end (void);
+#ifdef HAVE_MMAP
+static bool map_buffer (void);
+static bool unmap_file (char *fname);
+static bool spill_buffer (void);
+static void release (cindex from, cindex to, bool keep);
+static void page_out (void);
+#endif
+#if defined(WANT_UTF8) && defined(UTF8_BENCHMARK)
+static void utf8_benchmark (char *fname);
+#endif
 bool execute_unit (void); 
 void execute_all (void); 
-ecce_int case_op (ecce_int sym);                /* should be made a macro */
+static void select_case (int mode);
+static bool convert_right (void);
+static bool convert_left (void);
+static void convert_run (void);
+static unsigned long text_length (int p);
+static long count_lines (cindex from, cindex to);
+static void cursor_to (cindex q);
+static void cursor_back_to (cindex q);
+static void settle (void);
+static cindex ahead (void);
+static cindex behind (void);
+static bool step_right (void);
+static bool step_left (void);
+static void step_move (void);
+static void step_move_back (void);
+static long point (void);
+static void cursor_to_end (void);
+static cindex line_end (cindex p);
+static cindex scan_last (cindex lo, cindex hi, int c, int fold_bit);
+static cindex line_start (cindex p);
+static void cursor_to_start (void);
+static void right_chars (void);
+static void erase_chars (void);
+static cindex chars_on (cindex p, cindex e, long k, long *found);
+static cindex chars_back (cindex p, cindex b, long k, long *found);
+static void erase_chars_back (void);
+static bool kill_lines (bool back);
+static void insert_run (void);
+static void insert_back_run (void);
+static void left_chars (void);
+static void print_line (void);
+static void print_flush (void);
+static void global_edit (void);
+static bool lines_apart (int open);
+static bool run_lines (void);
+static void obey_line (void);
+static void obey_commands (char *lines);
+static void note_gap (void);
+static bool write_patch (FILE *f);
+#ifndef ECCE_LIBRARY
+static void serve (void);
+static void batch (char *list);
+static bool streamable (void);
+#endif
+static void move_lines (void);
+static void move_lines_back (void);
+static long count_chars (cindex from, cindex to);
+static bool goto_char (long n);
+static bool goto_line (long n);
 bool right (void); 
 bool left (void); 
 void right_star(void);                       /* Another macro */
@@ -259,15 +445,64 @@ bool verify_back (void);
 bool find (void); 
 bool find_back (void);
 
+/* A command line as analyse() left it, to be obeyed again elsewhere:
+   by batch() in each file, and by run_lines() in each thread */
+struct program {
+   int units;             /* how many of each table it uses */
+   int last;              /* its max_unit */
+   ecce_int *coms;        /* its copies of com[] and the rest */
+   int *links, *fails;
+   long *nums, *lims;
+   char *idioms;
+   ecce_char *texts;
+};
+
+static bool save_program (struct program *pr);
+static void load_program (struct program *pr);
+static void free_program (struct program *pr);
+
 /* Global variables */
 
-static unsigned long buffer_size = 0UL;
-static char *note_file;
-static bool  ok;
-static bool  printed;
-static long  stopper;
-static int   max_unit;
-static ecce_int pending_sym;
+/* Everything that belongs to one edit is kept in a struct ecce_session,
+   so that a program can have more than one (see ecce_open()), and the
+   code gets at it through ses, the session in hand. */
+
+#define PRINT_BUF 16384
+
+/* What ecce_run() answers */
+#define ECCE_OK      0   /* all obeyed */
+#define ECCE_FAILED  1   /* something failed, and said so */
+#define ECCE_DONE    2   /* %C has ended the edit */
+#define ECCE_ABORTED 3   /* ... or %A has */
+
+struct ecce_session {
+   char *parameter[4];   /* parameters - from, to, log, command */
+   char *commandp;
+   unsigned long buffer_size;
+   unsigned long min_buffer_size;    /* never shrink below the starting size */
+   unsigned long buffer_limit;       /* -max-size: never grow beyond this */
+#ifdef HAVE_MMAP
+   bool  use_mmap;                   /* -mmap: map the input file rather than read it */
+   size_t mapped_region;             /* length of the reservation at 'a', 0 if malloc'd */
+   size_t mapped_at;                 /* where in it the file is mapped */
+   unsigned long mapped_text;        /* length of the file, while it is still mapped */
+   struct stat mapped_stat;          /* to recognise the file again when saving */
+   unsigned long window_size;        /* -window: paging mode, text kept near the gap */
+   cindex paged_pp, paged_fp;        /* the gap when we last paged out */
+#endif
+   char *cursor_file;                /* -cursor-file: where %C leaves the final offset */
+   bool  serving;                    /* -server: commands and replies in frames, see serve() */
+   bool  diffing;                    /* -diff: %C writes only what changed, see write_patch() */
+   bool  tracking;                   /* either: note_gap() is wanted */
+   long  same_head, same_tail;       /* unchanged at either end, see note_gap() */
+   long  same_len;                   /* the length of the text they are measured against */
+   unsigned long file_bytes;         /* what load_file() read, CRs and all */
+   char *note_file;
+   bool  ok;
+   bool  printed;
+   long  stopper;
+   int   max_unit;
+   ecce_int pending_sym;
 
 /* significance of file pointers using the 'buffer gap' method: */
 
@@ -291,9 +526,9 @@ static ecce_int pending_sym;
    are:
 
    1) crash.  (what we did, prior to 2.7)
-   2) fail to insert (what we do now)
+   2) fail to insert (what we did up to 2.10b)
    3) expand the buffer (realloc, or malloc+free)
-      - I don't like this because at some point you do run out
+      - I didn't like this because at some point you do run out
         of RAM or VM, and have to fail anyway.  Since the most
         likely reason this is happening is a bad user command
         (eg (b0)0 ) rather than a file that is genuinely too large,
@@ -302,6 +537,26 @@ static ecce_int pending_sym;
         to what we had on EMAS) - but the argument against is just
         a delayed version of (3) above.
 
+   We now do (3), doubling the buffer whenever the gap runs out
+   (make_room) and handing memory back when a big deletion leaves
+   it mostly empty (trim_buffer), but with a hard ceiling set by
+   -max-size so that a runaway (b0)0 still fails rather than
+   eating all of memory.  That in turn lets us start with a buffer
+   only a little bigger than the file rather than three times it.
+
+   With -mmap we do a little of (4) as well: the input file is
+   mapped copy-on-write straight into the top of the buffer, so
+   that a big file is edited where it lies rather than copied in (see
+   map_buffer).  It is still read through once on opening, to count
+   lines and drop CRs.  Everything else works on it exactly as before.
+
+   And -window brings back Hamish's paging after a fashion: the
+   buffer is a shared mapping of a spill file, so the kernel can
+   always write it out rather than needing memory for all of it,
+   and page_out() drops whatever is more than a window's length
+   from the gap as the cursor moves.  Pages come back from the
+   spill file when the cursor returns to them.
+
    Note that the failure mode of this code is *not* atomic.
    A complete 'get line' or 'insert string' operation would fail
    in Hamish's implementation.  Here it fails on the individual
@@ -309,40 +564,107 @@ static ecce_int pending_sym;
    cost of the buffer-full test.
  */
 
-static cindex fbeg;
-static cindex lbeg;
-static cindex pp;
-static cindex fp;
-static cindex lend;
-static cindex fend;
-
-static int   type;
-static ecce_int command;
-static long  repeat_count;
-static long  limit;
-static int   pointer;
-static int   last_unit;
-static int   this_unit;
-static int   pos;
-static int   endpos;
-static ecce_int sym;        /************* sym has to be an int as
-                                        it is tested against EOF ************/
-static long  number;
-static cindex pp_before;
-static cindex fp_before;
-static cindex ms;
-static cindex ms_back;
-static cindex ml;
-static cindex ml_back;
-static int   to_upper_case;
-static int   to_lower_case;
-static int   caseflip;
-static bool  blank_line;
-static char *eprompt;
-static cindex noted;
-static int   changes;
-static bool  in_second;
-static char *com_prompt;
+   cindex fbeg;
+   cindex lbeg;
+   cindex pp;
+   cindex fp;
+   cindex lend;
+   cindex fend;
+
+   int   type;
+   ecce_int command;
+   long  repeat_count;
+   long  limit;
+   int   pointer;
+   int   last_unit;
+   int   this_unit;
+   int   pos;
+   int   endpos;
+   ecce_int sym;        /************* sym has to be an int as
+                                    it is tested against EOF ************/
+   long  number;
+   cindex pp_before;
+   cindex fp_before;
+   cindex ms;
+   cindex ms_back;
+   cindex ml;
+   cindex ml_back;
+   int   case_mode;                 /* 'L', 'U', 'N' or 'E': see select_case() */
+   bool  case_blind;                /* searches ignore case: all but %N */
+   unsigned char fold[256];         /* what each byte compares as */
+   unsigned char convert[256];      /* what C makes of each byte */
+   cindex (*match_at) (cindex q);   /* the matchers for the case mode */
+   cindex (*match_back_at) (cindex q);
+   bool  blank_line;
+   char *eprompt;
+   cindex noted;
+   int   changes;
+   bool  in_second;
+   cindex cursor;                   /* the cursor, when the gap has been left behind */
+   long  line_no;                   /* '\n's before the cursor: its line, from 0 */
+   long  line_count;                /* '\n's in the whole text */
+   long  main_line_no, main_line_count;   /* the main text's, in a secondary context */
+   char *com_prompt;
+
+   cindex a;
+   FILE *main_in;
+   FILE *main_out;
+   FILE *tty_in;
+   FILE *tty_out;
+   FILE *log_out;
+
+   ecce_int *com;
+   int  *link;
+   int  *fail_to;   /* where the search after a failure lands: the
+                       next ',' or ')' at the same depth, or the end */
+   ecce_char *text;
+   long *num;
+   long *lim;
+   unsigned short *skip;    /* search skip tables, 256 entries per unit */
+   signed char *skip_for;   /* the case mode each was built for, or -1 */
+   char *idiom;             /* for a '(': the loop it starts, if global_edit() or run_lines() knows it */
+
+   char print_buf[PRINT_BUF];      /* what P has still to write, see print_flush() */
+   size_t print_len;
+   long served_version;            /* -server: see serve() */
+   int  note_sec;                  /* the last secondary context, for %S */
+#ifdef WANT_UTF8
+   ecce_int fold_low[0x800];       /* fold_char() below U+0800, worked out in advance */
+#endif
+   bool embedded;                  /* run by ecce_run() rather than from main() */
+   bool borrowed;                  /* 'a' is the caller's, from ecce_open() */
+   bool quiet;                     /* tty_out is ours, and goes nowhere */
+   char *load_block;               /* load_file()'s, kept for the next file */
+   int  finished;                  /* ECCE_DONE or ECCE_ABORTED, once it is */
+   long failures;                  /* how many times fail_with() has been called */
+   jmp_buf bail;                   /* where %C and %A go in place of exit() */
+   int  jobs;                      /* -jobs: threads for batch() and run_lines() */
+   bool out_of_room;               /* make_room() has said no: see run_lines() */
+   bool forward;                   /* the line just analysed never goes back: see forward_only() */
+   FILE *stream_in;                /* streaming: the input still to come, see stream_more() */
+   size_t stream_carry;            /* ... bytes of a split UTF-8 sequence held over */
+   unsigned long streamed;         /* ... and how much of it has been read */
+};
+
+/* The session in hand.  Each thread has its own, so that separate
+   sessions can be run at the same time.  In the library it is whichever
+   the caller has passed in; ecce itself has just the one per thread, so
+   it is kept in place of a pointer to it, and reads like any global. */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+#ifdef ECCE_LIBRARY
+static THREAD_LOCAL struct ecce_session *ses = NULL;
+#else
+static THREAD_LOCAL struct ecce_session this_session;
+#define ses (&this_session)
+#endif
+
+static const char lazy_commands[] = "PpRrLlMmFfVvOY()\\?,";   /* which don't need the gap */
 
 static int symtype[256] = {
    ext+termin,          /*NL*/
@@ -424,7 +746,7 @@ static int symtype[256] = {
    sign+rep,            /*L*/
    sign+rep,            /*M*/
    0,                   /*N*/
-   err,                 /*O*/
+   rep,                 /*O*/
    sign+rep,            /*P*/
    err,                 /*Q*/
    sign+rep,            /*R*/
@@ -434,7 +756,7 @@ static int symtype[256] = {
    sign+txt,            /*V*/
    err,                 /*W*/
    err,                 /*X*/
-   err,                 /*Y*/
+   rep,                 /*Y*/
    err,                 /*Z*/
    ext+2,               /*[*/
    0,                   /*\*/
@@ -456,7 +778,7 @@ static int symtype[256] = {
    sign+rep,            /*L*/
    sign+rep,            /*M*/
    err,                 /*N*/
-   err,                 /*O*/
+   rep,                 /*O*/
    sign+rep,            /*P*/
    err,                 /*Q*/
    sign+rep,            /*R*/
@@ -466,7 +788,7 @@ static int symtype[256] = {
    sign+txt,            /*V*/
    err,                 /*W*/
    err,                 /*X*/
-   err,                 /*Y*/
+   rep,                 /*Y*/
    err,                 /*Z*/
    ext+2,               /*[*/
    0,                   /*\*/
@@ -497,19 +819,6 @@ static int sym_type(ecce_char c) {
   return err;
 }
 
-static cindex a;
-static FILE *main_in;
-static FILE *main_out;
-static FILE *tty_in;
-static FILE *tty_out;
-static FILE *log_out;
-
-static ecce_int *com;
-static int  *link;
-static ecce_char *text;
-static long *num;
-static long *lim;
-
 /*****************************************************************************/
 
 static int IntSeen = FALSE; /* set asynchronously by signal routine on ^C */
@@ -549,13 +858,40 @@ char *hex_to_ascii(char *hex) {
   return commandline;
 }
 
+/* Decode a -size or -max-size value: a number of bytes with an optional K or M */
+unsigned long size_parameter(char *buf_size_str) {
+  char *endptr;
+  unsigned long size;
+  errno = 0;
+  size = strtoul(buf_size_str, &endptr, 10);
+  if (errno != 0) {
+    fprintf(stderr, "%s: parámetro de tamaño incorrecto '%s'\n", ProgName, buf_size_str);
+    exit(1);
+  }
+  if ((*endptr != '\0') && (endptr[1] == '\0')) {
+    /* memo: removed strcasecmp for portability. Also avoiding toupper etc for locale simplification */
+    if (*endptr == 'k' || *endptr == 'K') {
+      size *= 1024UL;
+    } else if (*endptr == 'm' || *endptr == 'M') {
+      size *= (1024UL*1024UL);
+    } else {
+      fprintf(stderr,
+              "%s: tipo incorrecto de unidad '%s' (se espera %luK o %luM)\n",
+              ProgName, endptr, size, size);
+      exit(1);
+    }
+  }
+  return size;
+}
+
 char *backup_save;
 
+#ifndef ECCE_LIBRARY
 int main(int argc, char **argv) {
   static char backup_save_buf[256+L_tmpnam+1];
                                /* L_tmpnam on Win/DOS (LCC32) doesn't include path */
   int argno = 1, inoutlog = 0;
-  char *s;
+  char *s, *batch_list = NULL;
 
 #ifdef WANT_UTF8
   /* If your native locale doesn't use UTF-8 encoding 
@@ -565,6 +901,10 @@ int main(int argc, char **argv) {
   char *locale = setlocale(LC_ALL, "");
 #endif
 
+  if (!new_session ()) {
+    fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+    exit (40);
+  }
   backup_save = tmpnam(backup_save_buf);  /*SYS*/
 
   /* Historical code, not really needed nowadays as
@@ -586,45 +926,59 @@ int main(int argc, char **argv) {
       int offset = 1;
       if (argv[argno][1] == '-') offset += 1;
       if (strcmp(argv[argno]+offset, "desde") == 0) {
-        parameter[F] = argv[argno+1];
+        ses->parameter[F] = argv[argno+1];
       } else if (strcmp(argv[argno]+offset, "a") == 0) {
-        parameter[T] = argv[argno+1];
+        ses->parameter[T] = argv[argno+1];
       } else if (strcmp(argv[argno]+offset, "log") == 0) {
-        parameter[L] = argv[argno+1];
+        ses->parameter[L] = argv[argno+1];
       } else if (strcmp(argv[argno]+offset, "hex-command") == 0) {
-        if (parameter[C] != NULL) {
+        if (ses->parameter[C] != NULL) {
           fprintf(stderr, "%s: solo un -hex-command \"...\" o -comando \"...\" se permite\n", ProgName);
           exit(1);
         }
-        parameter[C] = hex_to_ascii(argv[argno+1]); commandp = parameter[C];
+        ses->parameter[C] = hex_to_ascii(argv[argno+1]); ses->commandp = ses->parameter[C];
       } else if (strcmp(argv[argno]+offset, "command") == 0) {
-        if (parameter[C] != NULL) {
+        if (ses->parameter[C] != NULL) {
           fprintf(stderr, "%s: only one -command \"...\" or -hex-command \"...\" is allowed\n", ProgName);
           exit(1);
         }
-        parameter[C] = argv[argno+1]; commandp = parameter[C];
+        ses->parameter[C] = argv[argno+1]; ses->commandp = ses->parameter[C];
+#if defined(WANT_UTF8) && defined(UTF8_BENCHMARK)
+      } else if (strcmp(argv[argno]+offset, "utf8-bench") == 0) {
+        utf8_benchmark (argv[argno+1]);
+#endif
       } else if (strcmp(argv[argno]+offset, "size") == 0) {
-        char *buf_size_str, *endptr;
-        buf_size_str = argv[argno+1];
-        errno = 0;
-        buffer_size = strtoul(buf_size_str, &endptr, 10);
-        if (errno != 0) {
-          fprintf(stderr, "%s: parámetro de tamaño incorrecto '%s'\n", ProgName, buf_size_str);
+        ses->buffer_size = size_parameter(argv[argno+1]);
+      } else if (strcmp(argv[argno]+offset, "max-size") == 0) {
+        ses->buffer_limit = size_parameter(argv[argno+1]);
+      } else if (strcmp(argv[argno]+offset, "window") == 0) {
+#ifdef HAVE_MMAP
+        ses->window_size = size_parameter(argv[argno+1]);
+#endif
+      } else if (strcmp(argv[argno]+offset, "cursor-file") == 0) {
+        ses->cursor_file = argv[argno+1];
+      } else if (strcmp(argv[argno]+offset, "batch") == 0) {
+        batch_list = argv[argno+1];
+      } else if (strcmp(argv[argno]+offset, "jobs") == 0) {
+        ses->jobs = (argv[argno+1] == NULL) ? 0 : atoi(argv[argno+1]);
+        if (ses->jobs < 1) {
+          fprintf(stderr, "%s: -jobs necesita un número de 1 en adelante\n", ProgName);
           exit(1);
-	}
-        if ((*endptr != '\0') && (endptr[1] == '\0')) {
-          /* memo: removed strcasecmp for portability. Also avoiding toupper etc for locale simplification */
-          if (*endptr == 'k' || *endptr == 'K') {
-            buffer_size *= 1024UL;
-	      } else if (*endptr == 'm' || *endptr == 'M') {
-            buffer_size *= (1024UL*1024UL);
-	  } else {
-            fprintf(stderr,
-                    "%s: tipo incorrecto de unidad '%s' (se espera %luK o %luM)\n",
-                    ProgName, endptr, buffer_size, buffer_size);
-            exit(1);
-	  }
-	}
+        }
+      } else if (strcmp(argv[argno]+offset, "mmap") == 0) {
+#ifdef HAVE_MMAP
+        ses->use_mmap = TRUE;
+#endif
+        argno += 1;      /* options without a value */
+        continue;
+      } else if (strcmp(argv[argno]+offset, "server") == 0) {
+        ses->serving = TRUE;
+        argno += 1;
+        continue;
+      } else if (strcmp(argv[argno]+offset, "diff") == 0) {
+        ses->diffing = TRUE;
+        argno += 1;
+        continue;
       } else {
         fprintf (stderr,
                  "%s: Opción desconocida '%s'\n",
@@ -634,204 +988,375 @@ int main(int argc, char **argv) {
       if (argv[argno+1] == NULL) argno += 1; else argno += 2;
     } else {
       /* positional parameters */
-      parameter[inoutlog++] = argv[argno++];
+      ses->parameter[inoutlog++] = argv[argno++];
+    }
+  }
+
+  if (ses->jobs == 0) {   /* -jobs, or one per processor */
+    ses->jobs = 1;
+#ifdef HAVE_THREADS
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1L) ses->jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  if (batch_list != NULL) {
+    if (ses->commandp == NULL) {
+      fprintf(stderr, "%s: -batch necesita -comando '...'\n", ProgName);
+      exit(1);
     }
+    batch (batch_list);
   }
 
-  if (buffer_size == 0UL) buffer_size = estimate_buffer_size(parameter[F]);
-   parameter[F] = argv[1];
+  if (ses->buffer_size == 0UL) ses->buffer_size = estimate_buffer_size(ses->parameter[F]);
+  if (ses->buffer_limit == 0UL) ses->buffer_limit = ses->buffer_size * 4UL + 64UL*1024UL*1024UL;
+  if (ses->buffer_size > ses->buffer_limit) ses->buffer_size = ses->buffer_limit;
+  ses->min_buffer_size = ses->buffer_size;
+   ses->parameter[F] = argv[1];
 
-   if (parameter[F] == NULL) {
+   if (ses->parameter[F] == NULL) {
       fprintf (stderr,
-         "%s: {-desde} fichero_entrada {{-to} fichero_salida}? {-log fichero}? {-{hex-}comando 'comandos;%%c'} {-tamaño_ bytes}?\n",
+         "%s: {-desde} fichero_entrada {{-to} fichero_salida}? {-log fichero}? {-{hex-}comando 'comandos;%%c'} {-tamaño_ bytes}? {-max-size bytes}? {-mmap}? {-window bytes}? {-cursor-file fichero}? {-server}? {-diff}? {-batch lista}? {-jobs n}?\n",
           ProgName);
       exit (30);
    }
 
    IntSeen = FALSE;
 
-   tty_in = stdin;
-   tty_out = stderr;
+   ses->tty_in = stdin;
+   ses->tty_out = stderr;
+
+   if (ses->serving && ((strcmp(ses->parameter[F], "-") == 0) || (strcmp(ses->parameter[F], "/dev/stdin") == 0)
+    || ((ses->parameter[T] != NULL) && ((strcmp(ses->parameter[T], "-") == 0) || (strcmp(ses->parameter[T], "/dev/stdout") == 0))))) {  /*SYS*/
+      fprintf(stderr, "%s: con -server la entrada y salida estándar son para el protocolo, no para el fichero\n", ProgName);
+      exit(1);
+   }
+
+   if (ses->diffing && (ses->parameter[T] == NULL)
+    && (strcmp(ses->parameter[F], "-") != 0) && (strcmp(ses->parameter[F], "/dev/stdin") != 0)) {  /*SYS*/
+      fprintf(stderr, "%s: -diff no puede escribir su parche sobre el fichero de entrada\n", ProgName);
+      exit(1);
+   }
+   ses->tracking = ses->serving || ses->diffing;
 
-   if ((strcmp(parameter[F], "-") == 0) || (strcmp(parameter[F], "/dev/stdin") == 0)) {  /*SYS*/
+   if ((strcmp(ses->parameter[F], "-") == 0) || (strcmp(ses->parameter[F], "/dev/stdin") == 0)) {  /*SYS*/
       /* If the input file is stdin, you cannot read commands from stdin as well. */
-      if (commandp == NULL) {
+      if (ses->commandp == NULL) {
         fprintf(stderr, "%s: \"-comando '...'\" opción requerida cuando el fichero de entrada es la entrada estándar\n", ProgName); exit(1);
       } 
-      main_in = stdin;
+      ses->main_in = stdin;
       /* What follows is a dirty hack to allow ecce to be used interactively as part of a pipe */
       /* I'm not at all sure this should even be supported */
-      tty_in = fopen("/dev/tty", "rb"); /*SYS*/
-      if (tty_in) {
+      ses->tty_in = fopen("/dev/tty", "rb"); /*SYS*/
+      if (ses->tty_in) {
 	fprintf(stderr, "%s: usando /dev/tty para entrada de comando\n", ProgName);
       } else {
-            tty_in = fopen("CON:", "r");
-            if (tty_in) { 
+            ses->tty_in = fopen("CON:", "r");
+            if (ses->tty_in) { 
 	       fprintf(stderr, "%s: usando CON: para entrada de comando\n", ProgName);
 	    } else {
-               tty_in = fopen("/dev/null", "rb");
-               if (tty_in == NULL) tty_in = fopen("NUL:", "rb");
+               ses->tty_in = fopen("/dev/null", "rb");
+               if (ses->tty_in == NULL) ses->tty_in = fopen("NUL:", "rb");
 	       fprintf(stderr, "%s: cuidado - no hay cadena de entrado de comando\n", ProgName);
-               if (tty_in == NULL) tty_in = stdin; /* It'll be EOF by the time it is used */
+               if (ses->tty_in == NULL) ses->tty_in = stdin; /* It'll be EOF by the time it is used */
 	    }
       }
    } else {
-      main_in = fopen (parameter[F], "rb");
+      ses->main_in = fopen (ses->parameter[F], "rb");
    }
 
-   if (main_in == NULL) {
-      fprintf (stderr, "Fichero \"%s\" no encontrado\n", parameter[F]);
+   if (ses->main_in == NULL) {
+      fprintf (stderr, "Fichero \"%s\" no encontrado\n", ses->parameter[F]);
       exit (30);
    }
 
-   if (parameter[L] == NULL) {
-      log_out = NULL;
+   if (ses->parameter[L] == NULL) {
+      ses->log_out = NULL;
    } else {
-      log_out = fopen (parameter[L], "wb");
-      if (log_out == NULL) {
+      ses->log_out = fopen (ses->parameter[L], "wb");
+      if (ses->log_out == NULL) {
          fprintf (stderr, "%s: Cuidado - No puedo crear \"%s\"\n",
-          ProgName, parameter[L]);
+          ProgName, ses->parameter[L]);
       }
    }
 
-   init_globals ();
+   if (!init_globals ()) {
+      fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+      exit (40);
+   }
+   fprintf (stderr, "Espacio de Almacén = %d KBytes\n", (int)(ses->buffer_size>>10));
 
-   a[0]           = '\n';
-   a[buffer_size] = '\n';
+   ses->a[0]                = '\n';
+   ses->a[ses->buffer_size] = '\n';
 
-   fprintf (tty_out, "Ecce\n");
+   fprintf (ses->tty_out, "Ecce\n");
 
-   if (main_in != NULL) load_file ();
+   if ((ses->main_in != NULL) && streamable ()) ses->stream_in = ses->main_in;
+   else if (ses->main_in != NULL) load_file ();
+   ses->same_len = (ses->pp - ses->fbeg) + (ses->fend - ses->fp);
+   ses->same_head = ses->same_tail = -1L;
+   if (ses->diffing && (ses->file_bytes != (unsigned long)ses->same_len)) {
+      /* CRs were dropped: offsets into the text aren't offsets into the file */
+      fprintf (stderr, "* -diff: el fichero tiene CR/LF, %%C escribirá el texto entero\n");
+      ses->diffing = FALSE;
+   }
 
    signal(SIGINT, &gotint);
 
    percent ('E'); /* Select either-case searches, case-flipping C command. */
-   for (;;) {
-      if (analyse ()) {
-         printed = FALSE;
-         execute_all ();
-         command = 'P';
-         repeat_count = 1L;
-         if (!printed) execute_command ();
-      }
+   if (ses->serving) serve ();
+   for (;;) obey_line ();
+}
+#endif
 
-      if (IntSeen) {
-        signal(SIGINT, &gotint);
+/* Read one command line and obey it */
+static void obey_line (void) {
+   if (analyse ()) {
+      ses->printed = FALSE;
+      execute_all ();
+      ses->command = 'P';
+      ses->repeat_count = 1L;
+      if (!ses->printed) execute_command ();
+   }
+   trim_buffer ();
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) page_out ();
+#endif
 
-        IntSeen = FALSE;
-        fprintf(stderr, "* Escape!\n");
-      }
+   if (IntSeen) {
+     signal(SIGINT, &gotint);
 
+     IntSeen = FALSE;
+     fprintf(ses->tty_out, "* Escape!\n");
    }
 }
 
-void init_globals (void) {
+/* A session with nothing in it yet, as the one in hand: init_globals()
+   fills it in once the options are known */
+static bool new_session (void) {
+#ifdef ECCE_LIBRARY
+   ses = calloc (1, sizeof(struct ecce_session));
+   if (ses == NULL) return FALSE;
+#else
+   (void)memset (ses, 0, sizeof(struct ecce_session));
+#endif
+   ses->note_sec = '0';
+   return TRUE;
+}
+
+/* Let go of the session in hand, and all that it holds */
+static void end_session (void) {
+   free_buffers ();
+#ifdef ECCE_LIBRARY
+   free (ses);
+   ses = NULL;
+#endif
+}
+
+bool init_globals (void) {
 
-   a = malloc ((buffer_size+1) * sizeof(ecce_char));
+   if (ses->a == NULL)   /* else ecce_open() has lent us the caller's */
+#ifdef HAVE_MMAP
+   if (!((ses->window_size != 0UL) ? spill_buffer () : (ses->use_mmap && map_buffer ())))
+#endif
+   ses->a = malloc ((ses->buffer_size+1) * sizeof(ecce_char));
 
-   note_file = malloc (Max_parameter+1);
+   ses->note_file = malloc (Max_parameter+1);
 
-   com  = (ecce_int *) malloc ((Max_command_units+1)*sizeof(ecce_int));
-   link = (int *) malloc ((Max_command_units+1)*sizeof(int));
-   text = (ecce_char *) malloc ((Max_command_units+1) * sizeof(ecce_char));
+   ses->com  = (ecce_int *) malloc ((Max_command_units+1)*sizeof(ecce_int));
+   ses->link = (int *) malloc ((Max_command_units+1)*sizeof(int));
+   ses->fail_to = (int *) malloc ((Max_command_units+1)*sizeof(int));
+   ses->text = (ecce_char *) malloc ((Max_command_units+1) * sizeof(ecce_char));
 
-   num = (long *) malloc ((Max_command_units+1)*sizeof(long));
-   lim = (long *) malloc ((Max_command_units+1)*sizeof(long));
+   ses->num = (long *) malloc ((Max_command_units+1)*sizeof(long));
+   ses->lim = (long *) malloc ((Max_command_units+1)*sizeof(long));
+   ses->skip = (unsigned short *) malloc ((Max_command_units+1)*256*sizeof(unsigned short));
+   ses->skip_for = (signed char *) malloc ((Max_command_units+1)*sizeof(signed char));
+   ses->idiom = (char *) malloc ((Max_command_units+1)*sizeof(char));
 
-   com_prompt = malloc (Max_prompt_length+1);
+   ses->com_prompt = malloc (Max_prompt_length+1);
 
-   if (a == NULL || note_file == NULL || com == NULL ||
-    link == NULL || text == NULL || num == NULL || lim == NULL ||
-    com_prompt == NULL) {
-      fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+   if (ses->a == NULL || ses->note_file == NULL || ses->com == NULL ||
+    ses->link == NULL || ses->fail_to == NULL || ses->text == NULL || ses->num == NULL || ses->lim == NULL ||
+    ses->skip == NULL || ses->skip_for == NULL || ses->idiom == NULL || ses->com_prompt == NULL) {
       free_buffers();
-      exit (40);
+      return FALSE;
+   }
+
+   ses->fbeg = ses->a+1;
+   ses->lbeg = ses->fbeg;
+   ses->pp = ses->lbeg;
+   ses->fp = ses->a+ses->buffer_size;
+   ses->lend = ses->fp;
+   ses->fend = ses->lend;
+   ses->ms = NULL;
+   ses->ms_back = NULL;
+   ses->stopper = 0 - 3L * (long)ses->buffer_size;   /* as long as the old fixed buffer let it run */
+   ses->max_unit = -1;
+   ses->pending_sym = '\n';
+   ses->blank_line = TRUE;
+
+   (void)strcpy (ses->note_file, NOTE_FILE);
+   ses->noted = NULL;
+   ses->changes = 0;
+   ses->line_no = 0L;
+   ses->line_count = 0L;
+   ses->in_second = FALSE;
+   (void)strcpy (ses->com_prompt, ">");
+   return TRUE;
+}
+
+void free_buffers (void) { /* only needed if checking that we have no heap lossage at end */
+#ifdef HAVE_MMAP
+  if (ses->mapped_region != 0) { (void)munmap (ses->a, ses->mapped_region); ses->a = NULL; }
+#endif
+  if (ses->borrowed) ses->a = NULL;   /* the caller's: see ecce_open() */
+  if (ses->a) free (ses->a); ses->a = NULL;
+  if (ses->lim) free (ses->lim); ses->lim = NULL;
+  if (ses->skip) free (ses->skip); ses->skip = NULL;
+  if (ses->skip_for) free (ses->skip_for); ses->skip_for = NULL;
+  if (ses->idiom) free (ses->idiom); ses->idiom = NULL;
+  if (ses->num) free (ses->num); ses->num = NULL;
+  if (ses->text) free (ses->text); ses->text = NULL;
+  if (ses->link) free (ses->link); ses->link = NULL;
+  if (ses->fail_to) free (ses->fail_to); ses->fail_to = NULL;
+  if (ses->com) free (ses->com); ses->com = NULL;
+  if (ses->com_prompt) free (ses->com_prompt); ses->com_prompt = NULL;
+  if (ses->load_block) free (ses->load_block); ses->load_block = NULL;
+  if (ses->note_file) free (ses->note_file); ses->note_file = NULL;
+}
+
+#define NUM_BUFFER_POINTERS (sizeof(buffer_pointers)/sizeof(buffer_pointers[0]))
+#define FIRST_TOP_POINTER 7
+
+/* Reallocate the buffer at new_size, opening or closing the gap by
+   the difference.  The caller guarantees that the text still fits. */
+static bool resize_buffer (unsigned long new_size) {
+   /* Every pointer into the buffer, so that they can be moved.  The
+      first group always lie below the gap; the second group (from fp
+      on) move with the top half.  We go by role rather than by address
+      because when the buffer is full pp == fp. */
+   cindex *buffer_pointers[] = {
+      &ses->fbeg, &ses->lbeg, &ses->pp, &ses->pp_before, &ses->ms_back, &ses->ml_back, &ses->noted,
+      &ses->fp, &ses->lend, &ses->fend, &ses->fp_before, &ses->ms, &ses->ml
+   };
+   long offset[NUM_BUFFER_POINTERS];
+   long delta = (long)new_size - (long)ses->buffer_size;
+   long top_start, top_length;
+   cindex new_a;
+   unsigned int i;
+
+#ifdef HAVE_MMAP
+   if (ses->mapped_region != 0) return FALSE;  /* can't move; it started at buffer_limit */
+#endif
+   settle ();
+   top_start = ses->fp - ses->a;
+   top_length = ses->a + ses->buffer_size + 1 - ses->fp; /* including the '\n' at the end */
+   for (i = 0; i < NUM_BUFFER_POINTERS; i++) {
+      cindex p = *buffer_pointers[i];
+      if (p == NULL) offset[i] = -1L;
+      else offset[i] = (p - ses->a) + ((i >= FIRST_TOP_POINTER) ? delta : 0L);
+   }
+   if (delta < 0L) (void)memmove (ses->a + top_start + delta, ses->a + top_start, top_length * sizeof(ecce_char));
+   new_a = realloc (ses->a, (new_size+1) * sizeof(ecce_char));
+   if (new_a == NULL) {
+      if (delta < 0L) {   /* can't happen in practice, but put things back */
+         (void)memmove (ses->a + top_start, ses->a + top_start + delta, top_length * sizeof(ecce_char));
+      }
+      return FALSE;
+   }
+   ses->a = new_a;
+   if (delta > 0L) (void)memmove (ses->a + top_start + delta, ses->a + top_start, top_length * sizeof(ecce_char));
+   ses->buffer_size = new_size;
+   ses->changes += delta;   /* 'A' compares the size of the gap with that at 'N' */
+   for (i = 0; i < NUM_BUFFER_POINTERS; i++) {
+      *buffer_pointers[i] = (offset[i] < 0L) ? NULL : ses->a + offset[i];
    }
+   return TRUE;
+}
 
-   fprintf (stderr, "Espacio de Almacén = %d KBytes\n", (int)(buffer_size>>10));
+/* Ensure that the gap has room for at least 'needed' more characters,
+   growing the buffer geometrically if it hasn't.  Fails only when that
+   would take the buffer beyond buffer_limit or memory runs out. */
+bool make_room (unsigned long needed) {
+   unsigned long gap = ses->fp - ses->pp, new_size;
 
+   if (gap >= needed) return TRUE;
+   if (needed - gap > ses->buffer_limit - ses->buffer_size) {
+      ses->out_of_room = TRUE;
+      return FALSE;
+   }
+   new_size = ses->buffer_size * 2UL;
+   if (new_size < ses->buffer_size + (needed - gap)) new_size = ses->buffer_size + (needed - gap);
+   if (new_size > ses->buffer_limit) new_size = ses->buffer_limit;
+   if (resize_buffer (new_size)) return TRUE;
+   ses->out_of_room = TRUE;
+   return FALSE;
+}
 
-   fbeg = a+1;
-   lbeg = fbeg;
-   pp = lbeg;
-   fp = a+buffer_size;
-   lend = fp;
-   fend = lend;
-   ms = NULL;
-   ms_back = NULL;
-   stopper = 0 - buffer_size;
-   max_unit = -1;
-   pending_sym = '\n';
-   blank_line = TRUE;
+/* Give memory back after a large deletion.  Called between commands. */
+void trim_buffer (void) {
+   unsigned long used = ses->buffer_size - (ses->fp - ses->pp), new_size;
 
-   (void)strcpy (note_file, NOTE_FILE);
-   noted = NULL;
-   changes = 0;
-   in_second = FALSE;
-   (void)strcpy (com_prompt, ">");
+   if ((ses->buffer_size <= ses->min_buffer_size) || (used > ses->buffer_size / 4UL)) return;
+   new_size = used * 2UL;
+   if (new_size < ses->min_buffer_size) new_size = ses->min_buffer_size;
+   (void)resize_buffer (new_size);
 }
 
-void free_buffers (void) { /* only needed if checking that we have no heap lossage at end */
-  if (a) free (a); a = NULL;
-  if (lim) free (lim); lim = NULL;
-  if (num) free (num); num = NULL;
-  if (text) free (text); text = NULL;
-  if (link) free (link); link = NULL;
-  if (com) free (com); com = NULL;
-  if (com_prompt) free (com_prompt); com_prompt = NULL;
-  if (note_file) free (note_file); note_file = NULL;
-  if (ProgName) free (ProgName); ProgName = NULL;
-}
-
-void local_echo (ecce_int *sym) {       /* Later, make this a char fn. */
+void local_echo (ecce_int *got) {       /* Later, make this a char fn. */
    ecce_int lsym;
 
-   if (commandp) {
-      lsym = *commandp;
-      if (lsym == '\0') {lsym = '\n'; commandp = NULL;} else commandp += 1;
-      blank_line = (lsym == '\n');
-      *sym = lsym;
-      if (log_out != NULL) {
-         fputwc (lsym, log_out);
+   if (ses->commandp) {
+      lsym = *ses->commandp;
+      if (lsym == '\0') {lsym = '\n'; ses->commandp = NULL;} else ses->commandp += 1;
+      ses->blank_line = (lsym == '\n');
+      *got = lsym;
+      if (ses->log_out != NULL) {
+         fputwc (lsym, ses->log_out);
       }
       return;
    }
 
-   if (blank_line) {fprintf(tty_out, "%s", eprompt); fflush(tty_out); }    /* stderr usually unbuffered, but flush needed for cygwin */
+   if (ses->serving || ses->embedded) {   /* the lines have run out: with -server stdin is for the next request */
+      ses->blank_line = TRUE;
+      *got = '\n';
+      return;
+   }
 
-   lsym = fgetwc (tty_in);
+   if (ses->blank_line) {fprintf(ses->tty_out, "%s", ses->eprompt); fflush(ses->tty_out); }    /* stderr usually unbuffered, but flush needed for cygwin */
+
+   lsym = fgetwc (ses->tty_in);
    if (IntSeen) {
      /* Tuned for windows */
      IntSeen = FALSE;
      signal(SIGINT, &gotint);
      lsym = '\n';
-     fputwc('^', tty_out); fputwc('C', tty_out); fputwc('\n', tty_out);
+     fputwc('^', ses->tty_out); fputwc('C', ses->tty_out); fputwc('\n', ses->tty_out);
    }
    
    if (lsym == WEOF) {
 
       IntSeen = FALSE;
       signal(SIGINT, SIG_IGN);
-      fputwc('\n', tty_out); /* Undo the prompt */
+      fputwc('\n', ses->tty_out); /* Undo the prompt */
 
       percent ('c');
       exit (50);
    }
 
-   if (log_out != NULL) {
-      fputwc (lsym, log_out);
+   if (ses->log_out != NULL) {
+      fputwc (lsym, ses->log_out);
    }
-   blank_line = (lsym == '\n');
-   *sym = lsym;
+   ses->blank_line = (lsym == '\n');
+   *got = lsym;
 }
 
 void read_sym (void) {
-   if (pending_sym == 0) {
-      do { local_echo (&sym); } while (sym == ' ');
+   if (ses->pending_sym == 0) {
+      do { local_echo (&ses->sym); } while (ses->sym == ' ');
                                /* Better test wanted for noise */
    } else {
-      sym = pending_sym;   /* C has an ungetc() but not very standard... */
-      pending_sym = 0;
+      ses->sym = ses->pending_sym;   /* C has an ungetc() but not very standard... */
+      ses->pending_sym = 0;
    }
 }
 
@@ -850,38 +1375,39 @@ bool fail_with (char *mess, ecce_int culprit) {
    culprit = culprit & (~plusbit);
    if (('A' <= culprit) && (culprit <= 'Z'))
       culprit = culprit | casebit;
-   fprintf (stderr, "* %s %lc%c\n", mess, culprit, dirn_sign);
-   do { read_sym (); } while (sym_type(sym) != sym_type(';'));
-   return (ok = FALSE);
+   fprintf (ses->tty_out, "* %s %lc%c\n", mess, culprit, dirn_sign);
+   ses->failures++;
+   do { read_sym (); } while (sym_type(ses->sym) != sym_type(';'));
+   return (ses->ok = FALSE);
 }
 
 
 void read_item(void) {
    ecce_int saved_digit;
    read_sym ();
-   if (isalpha(sym) && islower(sym)) sym = toupper(sym);
-   type = sym_type(sym);
-   if ((type & ext) == 0) return;
+   if (isalpha(ses->sym) && islower(ses->sym)) ses->sym = toupper(ses->sym);
+   ses->type = sym_type(ses->sym);
+   if ((ses->type & ext) == 0) return;
 
-   switch (type & 15) {
+   switch (ses->type & 15) {
 
       case star:
-         number = 0L;
+         ses->number = 0L;
          return;
 
       case pling:
-         number = stopper-1;
+         ses->number = ses->stopper-1;
          return;
 
       case dig:
-         saved_digit = sym;
-         number = 0L;
+         saved_digit = ses->sym;
+         ses->number = 0L;
          do {
-            number = (number * 10) + (sym - '0');
+            ses->number = (ses->number * 10) + (ses->sym - '0');
             read_sym();
-         } while (('0' <= sym) && (sym <= '9'));
-         pending_sym = sym;
-         sym = saved_digit; /* for printing in errors */
+         } while (('0' <= ses->sym) && (ses->sym <= '9'));
+         ses->pending_sym = ses->sym;
+         ses->sym = saved_digit; /* for printing in errors */
          return;
 
       default:
@@ -889,14 +1415,82 @@ void read_item(void) {
    }
 }
 
+/* Write the text from..to to f, leaving out the gap if it lies between
+   them.  The text on either side of the gap is all in one piece, so
+   that is one writev() of two pieces where we have it, or two fwrite()s,
+   rather than a call per character.  In paging mode it goes a window
+   at a time, each part being let go again once it is written. */
+static bool write_text (FILE *f, cindex from, cindex to) {
+   cindex span[2][2];
+   int spans = 0;
+
+   if ((from <= ses->pp) && (ses->fp <= to)) {
+      span[spans][0] = from; span[spans++][1] = ses->pp;
+      span[spans][0] = ses->fp; span[spans++][1] = to;
+   } else {
+      span[spans][0] = from; span[spans++][1] = to;
+   }
+#ifdef HAVE_MMAP
+   {
+      struct iovec iov[2];
+      int fd = fileno (f), i, n = 0;
+      size_t piece = (ses->window_size != 0UL) ? ses->window_size : (size_t)-1;
+
+      if (fflush (f) != 0) return FALSE;
+      for (i = 0; i < spans; i++) {
+         if (span[i][0] == span[i][1]) continue;
+         iov[n].iov_base = span[i][0];
+         iov[n++].iov_len = span[i][1] - span[i][0];
+      }
+      i = 0;
+      while (i < n) {
+         struct iovec *v = iov + i;
+         int count = n - i;
+         struct iovec one;
+         ssize_t done;
+
+         if (v->iov_len > piece) {   /* paging: one window's worth */
+            one.iov_base = v->iov_base;
+            one.iov_len = piece;
+            v = &one;
+            count = 1;
+         }
+         done = writev (fd, v, count);
+         if (done < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+         }
+         if (ses->window_size != 0UL) {
+            release ((cindex)iov[i].iov_base, (cindex)iov[i].iov_base + done, TRUE);
+         }
+         while ((i < n) && ((size_t)done >= iov[i].iov_len)) done -= iov[i++].iov_len;
+         if (i < n) {
+            iov[i].iov_base = (char *)iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+         }
+      }
+   }
+#else
+   {
+      int i;
+      for (i = 0; i < spans; i++) {
+         size_t n = span[i][1] - span[i][0];
+         if (fwrite (span[i][0], sizeof(ecce_char), n, f) != n) return FALSE;
+      }
+   }
+#endif
+   return TRUE;
+}
+
 void percent (ecce_int Command_sym) {
-   static int note_sec = '0'; /* This one MUST be a static */
    cindex P;
    int inoutlog;
    ecce_int sec_no;
    bool file_wanted; /* %s2 or %s2=fred ? */
+   bool saved = TRUE;
    char sec_file[256], *sec_filep;
-   ok = TRUE;
+   ses->ok = TRUE;
+   if (ses->in_second || (strchr ("CcW", Command_sym) == NULL)) settle ();   /* saving doesn't mind where the gap is */
    if (!isalpha(Command_sym)) {
       (void) fail_with ("letra para", '%');
       return;
@@ -904,84 +1498,76 @@ void percent (ecce_int Command_sym) {
    switch (Command_sym) {
 
       case 'L':
-         to_upper_case = ~0;
-         to_lower_case = casebit;
-/*         to_lower_case = 0; ---- standard ecce */
-         caseflip = 0;
-         break;
-
       case 'U':
-         to_upper_case = ~casebit;
-         to_lower_case = 0;
-/*         to_lower_case = casebit; ---- standard ecce */
-         caseflip = 0;
-         break;
-
       case 'N':
-         to_upper_case = ~0;
-         to_lower_case = 0;
-         caseflip = casebit;
-         break;
-
       case 'E':
-         to_upper_case = ~casebit; /* Only for searches - not in C command */
-         to_lower_case = 0;
-         caseflip = casebit;
+         select_case (Command_sym);
+         break;
+      case 'I':
+         {
+            long column = 0L;
+            cindex p;
+            for (p = ses->lbeg; p != ses->pp; p++) if (!is_cont (*p)) column++;
+            fprintf (ses->tty_out, "Línea %ld de %ld, columna %ld\n",
+                     ses->line_no + 1L, ses->line_count + 1L, column + 1L);
+         }
          break;
+
       case 'V':
-         fprintf (tty_out, "Ecce %s", VERSION);
+         fprintf (ses->tty_out, "Ecce %s", VERSION);
 #ifdef WANT_UTF8
-         fprintf (tty_out, "/UTF8");
+         fprintf (ses->tty_out, "/UTF8");
 #endif
-         fprintf (tty_out, " en C %s\n", DATE+7);
+         fprintf (ses->tty_out, " en C %s\n", DATE+7);
          break;
 
       case 'W':
-	if ((strcmp(parameter[parameter[T] == NULL ? F : T], "-") == 0) ||
-            ((parameter[T] != NULL) && (strcmp(parameter[T], "/dev/stdout") == 0))) { /*SYS*/
+         if (ses->embedded) {   /* there's no file: see ecce_open() */
+            (void) fail_with ("Sin fichero:", '%');
+            return;
+         }
+	if ((strcmp(ses->parameter[ses->parameter[T] == NULL ? F : T], "-") == 0) ||
+            ((ses->parameter[T] != NULL) && (strcmp(ses->parameter[T], "/dev/stdout") == 0))) { /*SYS*/
            fprintf(stderr, "* %%W no está permitido cuando la salida del fichero es stdout\n");
 	   break;
 	 }
       case 'C':
-         do { read_sym (); } while (sym_type(sym) != sym_type(';'));
+         do { read_sym (); } while (sym_type(ses->sym) != sym_type(';'));
    
       case 'c':
 
-         if (parameter[T] == NULL) {
+         if (ses->parameter[T] == NULL) {
             inoutlog = F;         /* So use input file as output file */
          } else {
             inoutlog = T;
          }
 
-         if (in_second) { /* Copied bit */
+         if (ses->in_second) { /* Copied bit */
          /*************** This block is copied from the %S code below;
            it ensures that the main edit buffer is pulled in when closing
            the edit and writing out the file.  This is a quick hack: I
            should change this and the copy in percent('S') so that both
            share the same subroutine ensure_main_edit() *****************/
-            FILE *sec_out = fopen (note_file, "wb");
-            (void)strcpy (com_prompt, ">");
+            FILE *sec_out = fopen (ses->note_file, "wb");
+            (void)strcpy (ses->com_prompt, ">");
             if (sec_out == NULL) {
                (void) fail_with ("No puedo guardar contexto", ' ');
                break;
             }
-            P = fbeg;
-            for (;;) {
-               if (P == pp) P = fp;
-               if (P == fend) break;
-               fputwc (*P++, sec_out);
-            }
+            (void) write_text (sec_out, ses->fbeg, ses->fend);
             fclose (sec_out);
-            pp = fbeg - 1;
-            fp = fend + 1;
-            fbeg = a+1;
-            fend = a+buffer_size;
-            lbeg = pp;
-            do { --lbeg; } while (*lbeg != '\n');
-            lbeg++;
-            lend = fp;
-            while (*lend != '\n') lend++;
-            in_second = FALSE;
+            ses->pp = ses->fbeg - 1;
+            ses->fp = ses->fend + 1;
+            ses->fbeg = ses->a+1;
+            ses->fend = ses->a+ses->buffer_size;
+            ses->lbeg = ses->pp;
+            do { --ses->lbeg; } while (*ses->lbeg != '\n');
+            ses->lbeg++;
+            ses->lend = ses->fp;
+            while (*ses->lend != '\n') ses->lend++;
+            ses->line_no = ses->main_line_no;
+            ses->line_count = ses->main_line_count;
+            ses->in_second = FALSE;
 /*
             if (sec_no == 0) {
                / * do nothing. Else note it and re-select it if this is
@@ -989,68 +1575,87 @@ void percent (ecce_int Command_sym) {
             }
  */
          }  /* End of copied bit */
+         if (ses->stream_in != NULL) stream_to_end ();   /* the rest of it */
+         if (ses->embedded) longjmp (ses->bail, ECCE_DONE);   /* the text is already where the caller wants it */
          if (Command_sym == 'c') {
-            parameter[inoutlog] = backup_save;
-            main_out = fopen (parameter[inoutlog], "wb");
-            if (main_out == NULL) {
+            ses->parameter[inoutlog] = backup_save;
+            ses->main_out = fopen (ses->parameter[inoutlog], "wb");
+            if (ses->main_out == NULL) {
                fprintf(stderr,
                        "Lo siento, no puedo guardar su edición (incluso %s ha fallado)\n", backup_save);
                exit(90);
             }
-            fprintf (tty_out, "Ecce abandonado: guardando en %s\n", parameter[inoutlog]);
+            fprintf (ses->tty_out, "Ecce abandonado: guardando en %s\n", ses->parameter[inoutlog]);
          } else {
-           if ((strcmp(parameter[inoutlog], "-") == 0) || (strcmp(parameter[inoutlog], "/dev/stdout") == 0)) /*SYS*/
-               main_out = stdout;
+           if ((strcmp(ses->parameter[inoutlog], "-") == 0) || (strcmp(ses->parameter[inoutlog], "/dev/stdout") == 0)) /*SYS*/
+               ses->main_out = stdout;
+#ifdef HAVE_MMAP
+            else if (!unmap_file (ses->parameter[inoutlog]))
+               ses->main_out = NULL;
+#endif
             else
-               main_out = fopen (parameter[inoutlog], "wb");
-            if (main_out == NULL) {
+               ses->main_out = fopen (ses->parameter[inoutlog], "wb");
+            if (ses->main_out == NULL) {
                fprintf (stderr,
                         "No puedo crear \"%s\" - intento guardarlo en %s en su lugar\n",
-                        parameter[inoutlog], backup_save);
-               main_out = fopen (backup_save, "w");
-               if (main_out == NULL) {
+                        ses->parameter[inoutlog], backup_save);
+               ses->main_out = fopen (backup_save, "w");
+               if (ses->main_out == NULL) {
                  fprintf(stderr, "Imposible guardar fichero de todos modos. Me rindo. Lo siento!\n");
                  exit(1);
 	       }
             } else {
                if (inoutlog == T) {
-                  fprintf (tty_out,
-                           "Ecce %s a %s completando.\n", parameter[F], parameter[T]);
+                  fprintf (ses->tty_out,
+                           "Ecce %s a %s completando.\n", ses->parameter[F], ses->parameter[T]);
                } else {
-                  fprintf (tty_out, "Ecce %s completando.\n", parameter[F]);
+                  fprintf (ses->tty_out, "Ecce %s completando.\n", ses->parameter[F]);
                }
             }
          }
 
-         P = fbeg;
-         for (;;) {
-            if (P == pp) P = fp;
-            if (P == fend) break;
-            fputwc (*P++, main_out);
+         if (ses->cursor_file != NULL) {   /* the final point, for whoever ran us */
+            FILE *f = fopen (ses->cursor_file, "wb");
+            if (f == NULL) {
+               fprintf (stderr, "* No puedo crear \"%s\": %s\n", ses->cursor_file, strerror (errno));
+            } else {
+               fprintf (f, "%ld\n", point () + 1L);
+               fclose (f);
+            }
+         }
+
+         if (!((ses->diffing && (Command_sym != 'c')) ? write_patch (ses->main_out) : write_text (ses->main_out, ses->fbeg, ses->fend))
+          || ((ses->main_out != stdout) ? (fclose (ses->main_out) != 0) : (fflush (ses->main_out) != 0))) {
+            fprintf (stderr, "* Error al escribir \"%s\": %s\n", ses->parameter[inoutlog], strerror (errno));
+            saved = FALSE;
          }
-         if (main_out != stdout) fclose (main_out);
 
          if (Command_sym == 'W') {
-            pending_sym = '\n';
+            ses->pending_sym = '\n';
             break;
          }
 
-         if (log_out != NULL) {
-            fclose (log_out);
+         if (ses->log_out != NULL) {
+            fclose (ses->log_out);
          }
 /*         fprintf (tty_out, "Ecce complete\n");      */
          free_buffers ();
-         exit (0);
+         exit (saved ? 0 : 1);   /* whoever ran us mustn't take a lost file for a saved one */
 
       case 'A':
-         if (log_out != NULL) {
-            fclose (log_out);
+         if (ses->embedded) longjmp (ses->bail, ECCE_ABORTED);
+         if (ses->log_out != NULL) {
+            fclose (ses->log_out);
          }
          fprintf (stderr, "\nAbortado!\n");
          free_buffers ();
          exit (60);
 
       case 'S':
+         if (ses->serving) {   /* the client knows only the main text */
+            (void) fail_with ("No con -server:", '%');
+            return;
+         }
          local_echo (&sec_no);
          file_wanted = FALSE;
          if (sym_type(sec_no) == sym_type(';')) {sec_no = 0;}
@@ -1067,11 +1672,11 @@ void percent (ecce_int Command_sym) {
                (void) fail_with ("%S", sec_no);
                return;
             }
-            local_echo (&sym);
-            if (sym == '=') {
+            local_echo (&ses->sym);
+            if (ses->sym == '=') {
                file_wanted = TRUE;
-            } else if (sym_type(sym) != sym_type(';')) {
-               (void) fail_with ("%S?", sym);
+            } else if (sym_type(ses->sym) != sym_type(';')) {
+               (void) fail_with ("%S?", ses->sym);
                return;
             }
          }
@@ -1079,47 +1684,44 @@ void percent (ecce_int Command_sym) {
            sec_filep = &sec_file[0];
            do {
              read_sym();
-             *sec_filep++ = sym;
-           } while (sym != '\n');
+             *sec_filep++ = ses->sym;
+           } while (ses->sym != '\n');
            *--sec_filep = '\0';
          }
-         pending_sym = '\n';
-         note_file[CONTEXT_OFFSET] = note_sec;
-         if (in_second) {
-            FILE *sec_out = fopen (note_file, "wb");
-            (void)strcpy (com_prompt, ">");
+         ses->pending_sym = '\n';
+         ses->note_file[CONTEXT_OFFSET] = ses->note_sec;
+         if (ses->in_second) {
+            FILE *sec_out = fopen (ses->note_file, "wb");
+            (void)strcpy (ses->com_prompt, ">");
             if (sec_out == NULL) {
                (void) fail_with ("No puede guardar contexto", ' ');
                return;
             }
-            P = fbeg;
-            for (;;) {
-               if (P == pp) P = fp;
-               if (P == fend) break;
-               fputwc (*P++, sec_out);
-            }
+            (void) write_text (sec_out, ses->fbeg, ses->fend);
             fclose (sec_out);
-            pp = fbeg - 1;
-            fp = fend + 1;
-            fbeg = a+1;
-            fend = a+buffer_size;
-            lbeg = pp;
-            do { --lbeg; } while (*lbeg != '\n');
-            lbeg++;
-            lend = fp;
-            while (*lend != '\n') lend++;
-            in_second = FALSE;
+            ses->pp = ses->fbeg - 1;
+            ses->fp = ses->fend + 1;
+            ses->fbeg = ses->a+1;
+            ses->fend = ses->a+ses->buffer_size;
+            ses->lbeg = ses->pp;
+            do { --ses->lbeg; } while (*ses->lbeg != '\n');
+            ses->lbeg++;
+            ses->lend = ses->fp;
+            while (*ses->lend != '\n') ses->lend++;
+            ses->line_no = ses->main_line_no;
+            ses->line_count = ses->main_line_count;
+            ses->in_second = FALSE;
             if (sec_no == 0) {
                return;
             }
          }
          if (sec_no == 0) sec_no = '0';
-         note_file[CONTEXT_OFFSET] = sec_no;
-         note_sec = sec_no;
+         ses->note_file[CONTEXT_OFFSET] = sec_no;
+         ses->note_sec = sec_no;
          {
             FILE *sec_in = (file_wanted
                              ? fopen (sec_file, "rb")
-                             : fopen (note_file, "rb"));
+                             : fopen (ses->note_file, "rb"));
             if (sec_in == NULL) {
                if (file_wanted) {
                   (void) fail_with ("No puede abrir fichero", ' ');
@@ -1128,267 +1730,427 @@ void percent (ecce_int Command_sym) {
                }
                return;
             }
-            (void)strcpy (com_prompt, "X>");
-            com_prompt[0] = sec_no;
-            in_second = TRUE;
-            *pp = '\n';
-
-            fbeg = pp + 1;
-            fend = fp - 1;
-            pp = fbeg;
-            fp = fend;
-            *fend = '\n';
-            lbeg = pp;
-            P = pp;
+            if (!make_room (3)) {
+               (void) fail_with ("%S corrupto - sin espacio", ' ');
+               fclose (sec_in);
+               return;
+            }
+            (void)strcpy (ses->com_prompt, "X>");
+            ses->com_prompt[0] = sec_no;
+            ses->in_second = TRUE;
+            ses->main_line_no = ses->line_no;
+            ses->main_line_count = ses->line_count;
+            *ses->pp = '\n';
+
+            ses->fbeg = ses->pp + 1;
+            ses->fend = ses->fp - 1;
+            ses->pp = ses->fbeg;
+            ses->fp = ses->fend;
+            *ses->fend = '\n';
+            ses->lbeg = ses->pp;
             for (;;) {
-               sym = fgetwc(sec_in);
-               if (sym == WEOF) break;
-               *P++ = sym;
-               if (P == fend) {
+               ses->sym = fgetwc(sec_in);
+               if (ses->sym == WEOF) break;
+               *ses->pp++ = ses->sym;
+               if ((ses->pp == ses->fend) && !make_room (1)) {
                   (void) fail_with ("%S corrupto - sin espacio", ' ');
                   fclose (sec_in);
                   return;
                }
             }
             fclose (sec_in);
-            while (P != pp) *--fp = *--P;
-            lend = fp;
-            while (*lend != '\n') lend++;
+            P = ses->pp;
+            ses->pp = ses->fbeg;
+            while (P != ses->pp) *--ses->fp = *--P;
+            ses->lend = ses->fp;
+            while (*ses->lend != '\n') ses->lend++;
+            ses->line_no = 0L;
+            ses->line_count = count_lines (ses->fp, ses->fend);
          }
          break;
 
       default:
          (void) fail_with ("Porciento", Command_sym);
    }
-   do { read_sym(); } while (sym_type(sym) != sym_type(';'));
+   do { read_sym(); } while (sym_type(ses->sym) != sym_type(';'));
 }
 
 void unchain(void) {
    do {
-      pointer = last_unit;
-      if (pointer < 0) return;
-      last_unit = link[pointer];
-      link[pointer] = this_unit;
-   } while (com[pointer] != '(');
+      ses->pointer = ses->last_unit;
+      if (ses->pointer < 0) return;
+      ses->last_unit = ses->link[ses->pointer];
+      ses->link[ses->pointer] = ses->this_unit;
+   } while (ses->com[ses->pointer] != '(');
+}
+
+/* Fill in fail_to[] for the units just stacked, working back from the
+   end: a failing unit's search goes on to the next unit, passing over
+   a bracketed group (whose '(' is linked to its ')') as a whole */
+static void chain_failures (void) {
+   int u, next;
+
+   ses->fail_to[ses->this_unit-1] = ses->this_unit-1;
+   for (u = ses->this_unit-2; u >= 0; u--) {
+      next = u+1;
+      switch (ses->com[next]) {
+         case ',': case ')': case 0:
+            ses->fail_to[u] = next;
+            break;
+         case '(':
+            ses->fail_to[u] = ses->fail_to[ses->link[next]];
+            break;
+         default:
+            ses->fail_to[u] = ses->fail_to[next];
+      }
+   }
+}
+
+/* The loops global_edit() can run by itself: (F/x/S/y/), (D/x/) and
+   (T/x/I/y/), marked on their '(' by the command after F, D or T.
+   Whether they repeat indefinitely is seen when the '(' is obeyed. */
+static void spot_idioms (void) {
+   int u;
+
+   for (u = 0; u < ses->this_unit; u++) {
+      ses->idiom[u] = 0;
+      if ((ses->com[u] == '(') && lines_apart (u)) {   /* see run_lines() */
+         ses->idiom[u] = 'M';
+         continue;
+      }
+      if ((ses->com[u] != '(') || (u + 2 >= ses->this_unit) || (ses->num[u+1] != 1L)) continue;
+      if (ses->text[ses->link[u+1]] == 0) continue;
+      if ((ses->com[u+1] == 'D') && (ses->com[u+2] == ')')) {
+         ses->idiom[u] = 'D';
+      } else if ((u + 3 < ses->this_unit) && (ses->com[u+3] == ')') && (ses->num[u+2] == 1L)
+       && (((ses->com[u+1] == 'F') && (ses->com[u+2] == 'S')) || ((ses->com[u+1] == 'T') && (ses->com[u+2] == 'I')))) {
+         ses->idiom[u] = ses->com[u+2];
+      }
+   }
+}
+
+/* Whether the line just analysed only ever goes on through the text,
+   never back to a line before the cursor's, as streaming needs (see
+   stream_more()).  Backward finds and moves, m, j, k and p, O and Y
+   are out; so are G, which takes its line from the terminal, A, which
+   wants the lines after the note kept, and P0, which prints until it
+   can't. */
+static bool forward_only (void) {
+   int u;
+
+   for (u = 0; u < ses->this_unit; u++) {
+      switch (ses->com[u] & ~plusbit) {
+         case 0: case '(': case ')': case ',': case '\\': case '?':
+         case 'R': case 'l': case 'L': case 'r': case 'E': case 'e': case 'C': case 'c':
+         case 'B': case 'b': case 'I': case 'i': case 'S': case 's': case 'V': case 'v':
+         case 'F': case 'T': case 'D': case 'U': case 'M': case 'K': case 'J': case 'N': case 'H':
+            break;
+         case 'P':
+            if (ses->num[u] < 1L) return FALSE;
+            break;
+         default:
+            return FALSE;
+      }
+   }
+   return TRUE;
 }
 
 void stack(void) {
-   com[this_unit]  = command;
-   link[this_unit] = pointer;
-   num[this_unit]  = repeat_count;
-   lim[this_unit]  = limit;
-   this_unit++;
+   ses->com[ses->this_unit]  = ses->command;
+   ses->link[ses->this_unit] = ses->pointer;
+   ses->num[ses->this_unit]  = ses->repeat_count;
+   ses->lim[ses->this_unit]  = ses->limit;
+   ses->skip_for[ses->this_unit] = -1;
+   ses->idiom[ses->this_unit] = 0;
+   ses->this_unit++;
+}
+
+/* P gathers what it prints in print_buf and writes it out in one go: tty_out
+   is usually stderr, which isn't buffered, so a character at a time
+   was a system call apiece */
+static void print_flush (void) {
+   if (ses->print_len != 0) (void)fwrite (ses->print_buf, 1, ses->print_len, ses->tty_out);
+   ses->print_len = 0;
+}
+
+static void print_char (int c) {
+   if (ses->print_len == PRINT_BUF) print_flush ();
+   ses->print_buf[ses->print_len++] = c;
+}
+
+static void print_str (const char *s, int n) {
+   if (n <= 0) return;   /* snprintf's failures */
+   if (ses->print_len + n > PRINT_BUF) print_flush ();
+   memcpy (ses->print_buf + ses->print_len, s, n);
+   ses->print_len += n;
+}
+
+/* The current line as P shows it */
+static void print_line (void) {
+   cindex i, mark;
+   char code[16];
+   int c;
+
+   if (ses->stream_in != NULL) stream_lines (1L);   /* all of it */
+   i = ses->lbeg;
+   mark = (ses->cursor != NULL) ? ses->cursor : ses->pp;
+   for (;;) {
+      if (i == ses->noted) {
+         print_str ("*** Nota ***", 12);
+         if (i == ses->lbeg) print_char ('\n');
+      }
+      if (i == mark) {
+         if (i != ses->lbeg) print_char ('^');
+         mark = NULL;
+      }
+      if (i == ses->pp) i = ses->fp;
+      if (i == ses->lend) break;
+      c = *i++;
+      c &= 0xff;
+      if (c > 127) {
+#ifdef WANT_UTF8
+         print_char (c); /* bytes of a UTF-8 sequence go out as they are */
+#else
+         /* Would use fputwc but it didn't output anything whereas %lc worked OK */
+         print_str (code, snprintf (code, sizeof(code), "%lc", c));
+#endif
+      } else if ((c < 32) || (c == 127)) {
+         print_str (code, sprintf (code, "<%d>", c));      /* or %2x ? */
+      } else print_char (c);
+   }
+   if (i == ses->fend) print_str ("*** Fin ***", 11);
+   print_char ('\n');
 }
 
 void execute_command(void) {
-   cindex i;
-   ecce_int sym;
+   ecce_int c;
 
-   ok = TRUE;
-   switch (command & (~plusbit)) {
+   ses->ok = TRUE;
+   if (strchr (lazy_commands, ses->command & (~plusbit)) == NULL) {
+      if (ses->cursor != NULL) settle ();
+      if (ses->tracking) note_gap ();
+   }
+   switch (ses->command & (~plusbit)) {
 
       case 'p':
       case 'P':
-         printed = TRUE;
-         i = lbeg;
-         for (;;) {
-            if (i == noted) {
-               fprintf (tty_out, "*** Nota ***");
-               if (i == lbeg) fputc ('\n', tty_out);
-            }
-            if (i == pp) {
-               if (i != lbeg) fputc ('^', tty_out);
-               i = fp;
+         ses->printed = TRUE;
+         print_line ();
+         while (ses->repeat_count != 1L) {   /* P<n>: every line into the one buffer */
+            if ((ses->command & minusbit) != 0) {
+               step_move_back (); cursor_back_to (ses->lbeg);
+            } else {
+               step_move ();
             }
-            if (i == lend) break;
-            sym = *i++;
-#ifdef WANT_UTF8
-            sym &= 0xffff;
-#else
-            sym &= 0xff;
-#endif
-            if (sym > 127) {
-	       /* Would use fputwc but it didn't output anything whereas %lc worked OK */
-               fprintf (tty_out, "%lc", sym);
-            } else if ((sym < 32) || (sym == 127)) {
-               fprintf (tty_out, "<%d>", sym);      /* or %2x ? */
-            } else fputc (sym, tty_out);
-         }
-         if (i == fend) fprintf (tty_out, "*** Fin ***");
-         fputc ('\n', tty_out);
-         if (repeat_count == 1L) return;
-         if ((command & minusbit) != 0) {
-            move_back (); left_star();
-         } else {
-            move ();
+            if (!ses->ok || IntSeen) break;
+            --ses->repeat_count;   /* as execute_unit() would have */
+            print_line ();
          }
+         print_flush ();
          return;
 
       case 'g':
       case 'G':
-         local_echo (&sym);
-
-         if (sym == ':') {
-            local_echo (&sym);
-            pending_sym = sym;
-            if (sym != '\n')
-               printed = TRUE;
-            ok = FALSE;
+         local_echo (&c);
+
+         if (c == ':') {
+            local_echo (&c);
+            ses->pending_sym = c;
+            if (c != '\n')
+               ses->printed = TRUE;
+            ses->ok = FALSE;
             return;
          }
          left_star();
          for (;;) {
-            if (pp == fp) /* FULL! */ { ok = FALSE; } else *pp++ = sym;
-            if (sym == '\n') break;
-            local_echo (&sym);
+            if ((ses->pp == ses->fp) && !make_room (1)) /* FULL! */ { ses->ok = FALSE; } else {
+               *ses->pp++ = c;
+               if (c == '\n') { ses->line_no++; ses->line_count++; }
+            }
+            if (c == '\n') break;
+            local_echo (&c);
          }
-         lbeg = pp;
-         if ((command & minusbit) != 0) {
+         ses->lbeg = ses->pp;
+         if ((ses->command & minusbit) != 0) {
             move_back();
-            printed = TRUE;
+            ses->printed = TRUE;
          }
          return;
 
       case 'E':
-         if (fp == lend) {
-            ok = FALSE;
+         if (ses->fp == ses->lend) {
+            ses->ok = FALSE;
             return;
          }
-         if (repeat_count == 0L) {
-            fp = lend;
-            ok = FALSE;
-         } else fp++;
+         if (ses->repeat_count == 0L) {
+            ses->fp = ses->lend;
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            erase_chars ();   /* E80: all in one go */
+         } else {
+            do ses->fp++; while ((ses->fp != ses->lend) && is_cont(*ses->fp));
+         }
          return;
 
       case 'e':
-         if (pp == lbeg) {
-            ok = FALSE;
+         if (ses->pp == ses->lbeg) {
+            ses->ok = FALSE;
             return;
          }
-         if (repeat_count == 0L) {
-            pp = lbeg;
-            ok = FALSE;
-         } else --pp;
+         if (ses->repeat_count == 0L) {
+            ses->pp = ses->lbeg;
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            erase_chars_back ();
+         } else {
+            do --ses->pp; while ((ses->pp != ses->lbeg) && is_cont(*ses->pp));
+         }
          return;
 
       case 'C':
-         if (fp == lend) {
-            ok = FALSE;
+         if (ses->fp == ses->lend) {
+            ses->ok = FALSE;
             return;
          }
-         sym = *fp++;
-         if (('a' <= (sym | casebit)) && ((sym | casebit) <= 'z')) {
-            if (caseflip != 0) {
-               *pp++ = sym ^ casebit;
-            } else {
-               *pp++ = ((sym ^ casebit) | to_lower_case) & to_upper_case;
-            }
+         if (ses->repeat_count != 1L) {
+            convert_run ();   /* C0, C80: the lot in one go */
          } else {
-            *pp++ = sym;
+            (void) convert_right ();
          }
          return;
 
       case 'c':
-         if (pp == lbeg) {
-            ok = FALSE;
+         if (ses->pp == ses->lbeg) {
+            ses->ok = FALSE;
             return;
          }
-         sym = *--pp;
-         if (('a' <= (sym | casebit)) && ((sym | casebit) <= 'z')) {
-            if (caseflip != 0) {
-               *--fp = sym ^ casebit;
-            } else {
-               *--fp = ((sym ^ casebit) | to_lower_case) & to_upper_case;
-            }
-         } else {
-            *--fp = sym;
-         }
+         (void) convert_left ();
          return;
 
       case 'l':
       case 'R':
-         if (repeat_count == 0L) {
-            right_star();
-            ok = FALSE;
-         } else (void) right ();
-         ms_back = NULL;
+         if (ses->repeat_count == 0L) {
+            (void) ahead ();   /* for lend above the gap */
+            cursor_to (ses->lend);
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            right_chars ();   /* R80: all in one go */
+         } else (void) step_right ();
+         ses->ms_back = NULL;
          return;
 
       case 'r':
       case 'L':
-         if (repeat_count == 0L) {
-            left_star();
-            ok = FALSE;
-         } else (void) left ();
-         ms = NULL;
+         if (ses->repeat_count == 0L) {
+            (void) behind ();
+            cursor_back_to (ses->lbeg);
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            left_chars ();
+         } else (void) step_left ();
+         ses->ms = NULL;
          return;
 
       case 'B':
-         if (pp == fp) /* FULL! */ { ok = FALSE; return; }
-         *pp++ = '\n';
-         lbeg = pp;
+         if ((ses->repeat_count > 1L) && make_room (ses->repeat_count)) {   /* B80: room for them all */
+            (void)memset (ses->pp, '\n', ses->repeat_count * sizeof(ecce_char));
+            ses->pp += ses->repeat_count;
+            ses->line_no += ses->repeat_count;
+            ses->line_count += ses->repeat_count;
+            ses->lbeg = ses->pp;
+            ses->repeat_count = 1L;
+            return;
+         }
+         if ((ses->pp == ses->fp) && !make_room (1)) /* FULL! */ { ses->ok = FALSE; return; }
+         *ses->pp++ = '\n';
+         ses->line_no++;
+         ses->line_count++;
+         ses->lbeg = ses->pp;
          return;
 
       case 'b':
-         if (pp == fp) /* FULL! */ { ok = FALSE; return; }
-         *--fp = '\n';
-         lend = fp;
+         if ((ses->repeat_count > 1L) && make_room (ses->repeat_count)) {
+            ses->fp -= ses->repeat_count;
+            (void)memset (ses->fp, '\n', ses->repeat_count * sizeof(ecce_char));
+            ses->line_count += ses->repeat_count;
+            ses->lend = ses->fp;
+            ses->repeat_count = 1L;
+            return;
+         }
+         if ((ses->pp == ses->fp) && !make_room (1)) /* FULL! */ { ses->ok = FALSE; return; }
+         *--ses->fp = '\n';
+         ses->line_count++;
+         ses->lend = ses->fp;
          return;
 
       case 'J':
          right_star();
-         if (fp == fend) {
-            ok = FALSE;
+         if (ses->fp == ses->fend) {
+            ses->ok = FALSE;
             return;
          }
-         lend = ++fp;
-         while (*lend != '\n')
-            lend++;
+         ses->line_count--;
+         ses->lend = line_end (++ses->fp);
          return;
 
       case 'j':
          left_star();
-         if (pp == fbeg) {
-            ok = FALSE;
+         if (ses->pp == ses->fbeg) {
+            ses->ok = FALSE;
             return;
          }
-         lbeg = --pp;
-         do { --lbeg; } while (*lbeg != '\n');
-         lbeg++;
+         ses->line_no--;
+         ses->line_count--;
+         ses->lbeg = line_start (--ses->pp);
          return;
 
       case 'M':
-         if (repeat_count == 0L) {
-            move_star();
-            ok = FALSE;
+         if (ses->repeat_count == 0L) {
+            cursor_to_end ();
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            move_lines ();   /* M80: all in one go */
          } else {
-            move ();
+            step_move ();
          }
          return;
 
       case 'm':
-         if (repeat_count == 0L) {
-            move_back_star();
-            ok = FALSE;
+         if (ses->repeat_count == 0L) {
+            cursor_to_start ();
+            ses->ok = FALSE;
+         } else if (ses->repeat_count > 1L) {
+            move_lines_back ();
          } else {
-            move_back(); left_star(); /* retain standard Edinburgh compatibility - my preference would have been to leave cursor at RHS */
+            step_move_back (); cursor_back_to (ses->lbeg); /* retain standard Edinburgh compatibility - my preference would have been to leave cursor at RHS */
          }
          return;
 
+      case 'O':
+         ses->ok = goto_char (ses->repeat_count);
+         ses->repeat_count = 1L;   /* a place, not a repeat count */
+         return;
+
+      case 'Y':
+         ses->ok = goto_line (ses->repeat_count);
+         ses->repeat_count = 1L;
+         return;
+
       case 'k':
       case 'K':
-         if ((command & minusbit) != 0) {
+         if ((ses->repeat_count > 1L) && kill_lines ((ses->command & minusbit) != 0)) return;   /* K80 */
+         if ((ses->command & minusbit) != 0) {
             move_back();
-            if (!ok) return;
+            if (!ses->ok) return;
          }
-         pp = lbeg;
-         fp = lend;
-         if (lend == fend) {
-            ok = FALSE;
+         ses->pp = ses->lbeg;
+         ses->fp = ses->lend;
+         if (ses->lend == ses->fend) {
+            ses->ok = FALSE;
             return;
          }
-         lend = ++fp ;
-         while (*lend != '\n') lend++;
+         ses->line_count--;
+         ses->lend = line_end (++ses->fp);
          return;
 
       case 'V':
@@ -1409,61 +2171,71 @@ void execute_command(void) {
 
       case 'U':
          if (!find ()) return;
-         pp = pp_before;
-         lbeg = pp;
-         do { --lbeg; } while (*lbeg != '\n');
-         lbeg++;
+         settle ();
+         ses->line_no -= count_lines (ses->pp_before, ses->pp);
+         ses->line_count -= count_lines (ses->pp_before, ses->pp);
+         ses->pp = ses->pp_before;
+         ses->lbeg = ses->pp;
+         do { --ses->lbeg; } while (*ses->lbeg != '\n');
+         ses->lbeg++;
          return;
 
       case 'u':
          if (!find_back ()) return;
-         fp = fp_before;
-         lend = fp;
-         while (*lend != '\n')
-            lend++;
+         settle ();
+         ses->line_count -= count_lines (ses->fp, ses->fp_before);
+         ses->fp = ses->fp_before;
+         ses->lend = ses->fp;
+         while (*ses->lend != '\n')
+            ses->lend++;
          return;
 
       case 'D':
          if (!find ()) return;
-         fp = ml;
-         ms = fp;
+         settle ();
+         ses->fp = ses->ml;
+         ses->ms = ses->fp;
          return;
 
       case 'd':
          if (!find_back ()) return;
-         pp = ml_back;
-         ms_back = pp;
+         settle ();
+         ses->pp = ses->ml_back;
+         ses->ms_back = ses->pp;
          return;
 
       case 'T':
          if (!find ()) return;
-         while (fp != ml) *pp++ = *fp++;
+         settle ();
+         while (ses->fp != ses->ml) *ses->pp++ = *ses->fp++;
          return;
 
       case 't':
          if (!find_back ()) return;
-         while (pp != ml_back) *--fp = *--pp;
+         settle ();
+         while (ses->pp != ses->ml_back) *--ses->fp = *--ses->pp;
          return;
 
       case 'I':
-         insert ();
+         if (ses->repeat_count > 1L) insert_run (); else insert ();
          return;
 
       case 'i':
-         insert_back ();
+         if (ses->repeat_count > 1L) insert_back_run (); else insert_back ();
          return;
 
       case 's':
       case 'S':
-         if (fp == ms) {
-            fp = ml;
-         } else if (pp == ms_back) {
-            pp = ml_back;
+         if (ses->fp == ses->ms) {
+            ses->fp = ses->ml;
+         } else if (ses->pp == ses->ms_back) {
+            ses->pp = ses->ml_back;
          } else {
-            ok = FALSE;
+            ses->ok = FALSE;
             return;
          }
-         if ((command & minusbit) != 0) {
+         if (ses->tracking) note_gap ();   /* the match may be gone from the other side */
+         if ((ses->command & minusbit) != 0) {
             insert_back ();
          } else {
             insert ();
@@ -1471,120 +2243,121 @@ void execute_command(void) {
          return;
 
       case '(':
-         num[pointer] = repeat_count;
-         repeat_count = 1L;
+         ses->num[ses->pointer] = ses->repeat_count;
+         ses->repeat_count = 1L;
+         if ((ses->num[ses->pointer] == 0L) && (ses->idiom[ses->this_unit] == 'M')) (void) run_lines ();
+         else if ((ses->num[ses->pointer] == 0L) && (ses->idiom[ses->this_unit] != 0)) global_edit ();
          return;
 
       case ')':
-         --(num[this_unit]);
-         if ((0 != num[this_unit]) && (num[this_unit] != stopper)) {
-            this_unit = pointer;
+         --(ses->num[ses->this_unit]);
+         if ((0 != ses->num[ses->this_unit]) && (ses->num[ses->this_unit] != ses->stopper)) {
+            ses->this_unit = ses->pointer;
          }
-         repeat_count = 1L;
+         ses->repeat_count = 1L;
          return;
 
       case '\\':
-         ok = FALSE;
+         ses->ok = FALSE;
          return;
 
       case '?':
          return;
 
       case ',':
-         this_unit = pointer - 1;
+         ses->this_unit = ses->pointer - 1;
          return;
 
       case 'N':
-         noted = pp;
-         changes = fp-pp;
+         ses->noted = ses->pp;
+         ses->changes = ses->fp-ses->pp;
          return;
 
       case 'A':
-         if ((noted == NULL)
-          || (noted >= pp)
-          || (changes != fp-pp)) {                    /*BUG*/
-            ok = FALSE;
+         if ((ses->noted == NULL)
+          || (ses->noted >= ses->pp)
+          || (ses->changes != ses->fp-ses->pp)) {                    /*BUG*/
+            ses->ok = FALSE;
             return;
          }
-         note_file[CONTEXT_OFFSET] = lim[this_unit]+'0';
+         ses->note_file[CONTEXT_OFFSET] = ses->lim[ses->this_unit]+'0';
          {
-            FILE *note_out = fopen (note_file, "wb");
-            cindex p = noted;
+            FILE *note_out = fopen (ses->note_file, "wb");
+            cindex p = ses->noted;
 
             if (note_out == NULL) {
-               ok = FALSE;
+               ses->ok = FALSE;
                return;
             }
 
-            do {
-               fputwc (*p++, note_out);
-            } while (p != pp);
+            (void) write_text (note_out, p, ses->pp);
 
             fclose (note_out);
 
-            pp = noted;
-            lbeg = pp;
-            do { --lbeg; } while (*lbeg != '\n');
-            lbeg++;
+            ses->line_no -= count_lines (ses->noted, ses->pp);
+            ses->line_count -= count_lines (ses->noted, ses->pp);
+            ses->pp = ses->noted;
+            ses->lbeg = ses->pp;
+            do { --ses->lbeg; } while (*ses->lbeg != '\n');
+            ses->lbeg++;
          }
-         noted = NULL;
+         ses->noted = NULL;
          return;
 
       case 'H':
-         note_file[CONTEXT_OFFSET] = lim[this_unit]+'0';
+         ses->note_file[CONTEXT_OFFSET] = ses->lim[ses->this_unit]+'0';
          {
-            FILE *note_in = fopen (note_file, "rb");
+            FILE *note_in = fopen (ses->note_file, "rb");
+            long from = ses->pp - ses->a;   /* make_room() may move the buffer */
             if (note_in == NULL) {
-               ok = FALSE;
+               ses->ok = FALSE;
                return;
             }
 
-            { cindex p = pp;
-
-               for (;;) {
-                  sym = fgetwc(note_in);
-                  if (sym == WEOF) break;
-                  if (p == fp) {
-                     ok = FALSE;
-                     break;
-                  }
-                  *p++ = sym;
+            for (;;) {
+               c = fgetwc(note_in);
+               if (c == WEOF) break;
+               if ((ses->pp == ses->fp) && !make_room (1)) {
+                  ses->ok = FALSE;
+                  break;
                }
-               pp = p;
+               *ses->pp++ = c;
             }
-            lbeg = pp;
-            do { --lbeg; } while (*lbeg != '\n');
-            lbeg++;
+            ses->line_no += count_lines (ses->a + from, ses->pp);
+            ses->line_count += count_lines (ses->a + from, ses->pp);
+            ses->lbeg = ses->pp;
+            do { --ses->lbeg; } while (*ses->lbeg != '\n');
+            ses->lbeg++;
             fclose (note_in);
          }
          return;
 
       default:
-         (void) fail_with ("Comando desconocido", command);
+         (void) fail_with ("Comando desconocido", ses->command);
          return;
    }
 }
 
 void Scan_sign(void) {
    read_sym ();
-   if (sym_type(sym) == sym_type('+')) {
-      command = command | plusbit;
-   } else if ((sym_type(sym) == sym_type('-')) &&
-            (('A' <= command) && (command <= 'Z'))) {
-      command = command | minusbit;
+   if (sym_type(ses->sym) == sym_type('+')) {
+      ses->command = ses->command | plusbit;
+   } else if ((sym_type(ses->sym) == sym_type('-')) &&
+            (('A' <= ses->command) && (ses->command <= 'Z'))) {
+      ses->command = ses->command | minusbit;
    } else {
-      pending_sym = sym;
+      ses->pending_sym = ses->sym;
    }
 }
 
 void Scan_scope(void) {                      /* ditto macro */
-   ecce_int uppercase_command = command & (~(minusbit | plusbit));
-   if ((uppercase_command == 'D') || (uppercase_command == 'U')) number = 1L; else number = 0L;
+   ecce_int uppercase_command = ses->command & (~(minusbit | plusbit));
+   if ((uppercase_command == 'D') || (uppercase_command == 'U')) ses->number = 1L; else ses->number = 0L;
    read_item ();
-   if ((type & numb) == 0) pending_sym = sym;
-   limit = number;
+   if ((ses->type & numb) == 0) ses->pending_sym = ses->sym;
+   ses->limit = ses->number;
    if (('H' == uppercase_command) || (uppercase_command == 'A')) {
-      if (!((0L <= limit) && (limit <= 9L))) limit = '?'-'0';
+      if (!((0L <= ses->limit) && (ses->limit <= 9L))) ses->limit = '?'-'0';
    }
 }
  
@@ -1592,456 +2365,3455 @@ void Scan_text(void) {
    ecce_int last;
 
    read_sym ();
-   last = sym;
-   if ((sym_type(sym) & delim) == 0) {
-      pending_sym = sym;
-      (void) fail_with ("Texto para", command);
+   last = ses->sym;
+   if ((sym_type(ses->sym) & delim) == 0) {
+      ses->pending_sym = ses->sym;
+      (void) fail_with ("Texto para", ses->command);
       return;
    }
-   if (('a' <= command) && (command <= 'z')) {
-      text[endpos] = 0;
+   if (('a' <= ses->command) && (ses->command <= 'z')) {
+      ses->text[ses->endpos] = 0;
       for (;;) {
-         local_echo (&sym);
-         if (sym == last) break;
-         if (sym == '\n') {
-            pending_sym = '\n';
+         local_echo (&ses->sym);
+         if (ses->sym == last) break;
+         if (ses->sym == '\n') {
+            ses->pending_sym = '\n';
             break;
          }
-         text[--endpos] = sym;
+         ses->text[--ses->endpos] = ses->sym;
       }
-      pointer = endpos--;
+      ses->pointer = ses->endpos--;
    } else {
-      pointer = pos;
+      ses->pointer = ses->pos;
       for (;;) {
-         local_echo (&sym);
-         if (sym == last) break;
-         if (sym == '\n') {
-            pending_sym = '\n';
+         local_echo (&ses->sym);
+         if (ses->sym == last) break;
+         if (ses->sym == '\n') {
+            ses->pending_sym = '\n';
             break;
          }
-         text[pos++] = sym;
+         ses->text[ses->pos++] = ses->sym;
       }
-      text[pos++] = 0;
+      ses->text[ses->pos++] = 0;
    }
-   ok = TRUE;
+   ses->ok = TRUE;
 }
 
 void Scan_repeat (void) {
-   number = 1L;
+   ses->number = 1L;
    read_item ();
-   if ((type & numb) == 0) pending_sym = sym;
-   repeat_count = number;
+   if ((ses->type & numb) == 0) ses->pending_sym = ses->sym;
+   ses->repeat_count = ses->number;
 }
 
 bool analyse (void) {
    int saved_type;
 
-   ok = TRUE;
-   pos = 0;
-   endpos = Max_command_units;
-   this_unit = 0;
-   last_unit = -1;
-   eprompt = com_prompt;
-   do { read_item (); } while (type == sym_type(';'));
-   command = sym;
-   if (command == '%') {
+   ses->ok = TRUE;
+   ses->pos = 0;
+   ses->endpos = Max_command_units;
+   ses->this_unit = 0;
+   ses->last_unit = -1;
+   ses->eprompt = ses->com_prompt;
+   do { read_item (); } while (ses->type == sym_type(';'));
+   ses->command = ses->sym;
+   if (ses->command == '%') {
       read_sym();
-      if (sym_type(sym) == sym_type(';')) {
-         pending_sym = sym;
-         sym = 0;
+      if (sym_type(ses->sym) == sym_type(';')) {
+         ses->pending_sym = ses->sym;
+         ses->sym = 0;
       }
-      percent (((('a' <= sym) && (sym <= 'z')) ? (sym - casebit) : sym  ));
-      return (ok = FALSE); /* to inhibit execution */
+      percent (((('a' <= ses->sym) && (ses->sym <= 'z')) ? (ses->sym - casebit) : ses->sym  ));
+      return (ses->ok = FALSE); /* to inhibit execution */
    }
-   if ((type & numb) != 0) {
-      if (max_unit > 0) {
-         num[max_unit] = number;
+   if ((ses->type & numb) != 0) {
+      if (ses->max_unit > 0) {
+         ses->num[ses->max_unit] = ses->number;
       } else {
-         return (ok = FALSE);
+         return (ses->ok = FALSE);
       }
       read_item();
-      if (type != sym_type(';'))
-         (void) fail_with ("?", sym);
-      pending_sym = sym;
-      return (ok);
+      if (ses->type != sym_type(';'))
+         (void) fail_with ("?", ses->sym);
+      ses->pending_sym = ses->sym;
+      return (ses->ok);
    }
    for (;;) {  /* on items */
-      if ((type & err) != 0) {
-         return (fail_with ("Comando", command));
+      if ((ses->type & err) != 0) {
+         return (fail_with ("Comando", ses->command));
       }
-      if ((type & delim) != 0) {
-         return (fail_with ("Comando antes", command));
+      if ((ses->type & delim) != 0) {
+         return (fail_with ("Comando antes", ses->command));
       }
-      if ((type & numb) != 0) {
-         return (fail_with ("Conteo de repetición inesperado", command));
+      if ((ses->type & numb) != 0) {
+         return (fail_with ("Conteo de repetición inesperado", ses->command));
       }
-      limit = 0L;
-      pointer = 0;
-      repeat_count = 1L;
-      if ((type & ext) == 0) {
-         saved_type = type;           /* All this needs a tidy-up */
+      ses->limit = 0L;
+      ses->pointer = 0;
+      ses->repeat_count = 1L;
+      if ((ses->type & ext) == 0) {
+         saved_type = ses->type;           /* All this needs a tidy-up */
          if ((saved_type & sign) != 0) Scan_sign ();
          if ((saved_type & scope) != 0) Scan_scope ();
          if ((saved_type & txt) != 0) Scan_text ();
-         if (!ok) return (ok);
+         if (!ses->ok) return (ses->ok);
          if ((saved_type & rep) != 0) Scan_repeat ();
-         type = saved_type;
+         ses->type = saved_type;
       } else {
-         switch (type & 15) {
+         switch (ses->type & 15) {
 
             case termin:
-               pending_sym = '\n';  /* for skipping on error */
+               ses->pending_sym = '\n';  /* for skipping on error */
                unchain ();
-               if (pointer >= 0) {
+               if (ses->pointer >= 0) {
                   return (fail_with ("Faltante", ')'));
                }
-               max_unit = this_unit;
-               repeat_count = 1L;
-               command = ')';
+               ses->max_unit = ses->this_unit;
+               ses->repeat_count = 1L;
+               ses->command = ')';
                stack ();
-               command = 0;
+               ses->command = 0;
                stack ();
-               return (ok);
+               chain_failures ();
+               spot_idioms ();
+               ses->forward = forward_only ();
+               return (ses->ok);
 
             case lpar:
-               command = '(';
-               pointer = last_unit;
-               last_unit = this_unit;
+               ses->command = '(';
+               ses->pointer = ses->last_unit;
+               ses->last_unit = ses->this_unit;
                break;
 
             case comma:
-               command = ',';
-               pointer = last_unit;
-               last_unit = this_unit;
+               ses->command = ',';
+               ses->pointer = ses->last_unit;
+               ses->last_unit = ses->this_unit;
                break;
 
             case rpar:
-               command = ')';
+               ses->command = ')';
                Scan_repeat ();
                unchain ();
-               if (pointer < 0) {
+               if (ses->pointer < 0) {
                   return (fail_with ("Faltante", '('));
                }
-               num[pointer] = repeat_count;
+               ses->num[ses->pointer] = ses->repeat_count;
                break;
          }
       }
       stack ();
       read_item ();
-      command = sym;
+      ses->command = ses->sym;
    }  /* on items */
 }
 
-void load_file (void) {
-   cindex p = fbeg;
-   ecce_int sym;
-
-   sym = fgetwc(main_in);
-   while (sym != WEOF) {
-       if (sym != '\r') { /* Ignore CR in CR/LF on DOS/Win */
-        *p++ = sym;
-        if (p == fend) {
-           fprintf (stderr, "* Fichero muy grande!\n");
-           percent ('A');
-        }
-      }
-
-      sym = fgetwc(main_in);
 #ifdef WANT_UTF8
-      if (errno == EILSEQ) {
-	fprintf(stderr, "Se encontró un caracter ancho inválido. Puede necesitar ejecutar: export LC_ALL=en_US.UTF-8\n");  /*SYS*/
-	exit(1);                                                
-      }
-#endif
-   }
-   fclose (main_in);
-
-   while (p != fbeg) *--fp = *--p;
-   lend = fp;
-   while (*lend != '\n')
-      lend++;
-}
-
-bool execute_unit (void) {
-   ecce_int culprit;
-
-   command = com[this_unit];
-   culprit = command;
-   pointer = link[this_unit];
-
-   repeat_count = num[this_unit];
-   for (;;) {  /* On repeats of this_unit */
-      if (IntSeen) {
-        return (ok = FALSE);
+/* Locale-independent UTF-8 check used by load_file().  The bytes are
+   copied into the buffer as they are, so the only work is validation:
+   runs of plain ASCII (with no CR in them) are passed over 32 or 16
+   bytes at a time when the compiler offers AVX2 or SSE2; everything
+   else goes through the scalar loop below, which rejects overlong
+   forms, surrogates and code points beyond U+10FFFF.  CRs are dropped
+   as they are met.
+
+   Copying stops at the end of the input, when the output reaches
+   'last', or in front of a sequence that is cut short by the end of
+   the block (the caller carries those bytes over to the next block).
+   On a malformed sequence it returns FALSE with *bp left pointing at
+   the first byte of that sequence. */
+
+static bool utf8_copy (const unsigned char **bp, const unsigned char *e,
+                       cindex *op, cindex last) {
+   const unsigned char *b = *bp;
+   cindex o = *op;
+   bool valid = TRUE;
+
+   while (b != e) {
+      const unsigned char *chunk_end;
+#if defined(__AVX2__)
+      while ((e - b >= 32) && (last - o >= 32)) {
+         __m256i v = _mm256_loadu_si256 ((const __m256i *)b);
+         __m256i cr = _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r'));
+         if (_mm256_movemask_epi8 (_mm256_or_si256 (v, cr)) != 0) break;
+         _mm256_storeu_si256 ((__m256i *)o, v);
+         b += 32; o += 32;
       }
-      execute_command ();
-      --repeat_count;
-      if (ok) {
-         if (repeat_count == 0L || repeat_count == stopper) {
-           return (ok);
-         }
-         continue;
+#elif defined(__SSE2__)
+      while ((e - b >= 16) && (last - o >= 16)) {
+         __m128i v = _mm_loadu_si128 ((const __m128i *)b);
+         __m128i cr = _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r'));
+         if (_mm_movemask_epi8 (_mm_or_si128 (v, cr)) != 0) break;
+         _mm_storeu_si128 ((__m128i *)o, v);
+         b += 16; o += 16;
       }
-      ok = TRUE;
-      for (;;) {  /* scanning for end of unit (e_g_ ')') */
-         if (IntSeen) {
-           return (ok = FALSE);
-         }
-         if (repeat_count < 0L ) {
-           if (com[this_unit+1] == '\\') {
-              this_unit++;
-              return (ok = FALSE);
-           }
-           return (ok);
+#endif
+      /* Scalar code handles at least the chunk the vector loop refused */
+      chunk_end = (e - b > 32) ? b + 32 : e;
+      while (b < chunk_end) {
+         unsigned int c = *b, need, min2 = 0x80, max2 = 0xBF;
+         size_t i;
+
+         if (c < 0x80) {
+            if (c != '\r') {             /* Ignore CR in CR/LF on DOS/Win */
+               if (o == last) goto done;
+               *o++ = c;
+            }
+            b++;
+            continue;
          }
-         if ((com[this_unit+1] == '\\') || (com[this_unit+1] == '?')) {
-            this_unit++;
-            return (ok);
+         if ((0xC2 <= c) && (c <= 0xDF)) {
+            need = 1;
+         } else if ((0xE0 <= c) && (c <= 0xEF)) {
+            need = 2;
+            if (c == 0xE0) min2 = 0xA0;        /* overlong */
+            if (c == 0xED) max2 = 0x9F;        /* surrogates */
+         } else if ((0xF0 <= c) && (c <= 0xF4)) {
+            need = 3;
+            if (c == 0xF0) min2 = 0x90;        /* overlong */
+            if (c == 0xF4) max2 = 0x8F;        /* > U+10FFFF */
+         } else {
+            valid = FALSE; goto done;
          }
-         /* indefinite repetition never fails */
-         for (;;) {  /* scanning for end of sequence */
-            if (IntSeen) {
-              return (ok = FALSE);
-            }
-            this_unit++;
-            command = com[this_unit];
-            switch (command) {
-
-               case '(':
-                  this_unit = link[this_unit];
-                  break; /* Skip over (...) as if it were single command. */
-
-               case ',':
-                  return (ok);
-
-               case ')': /* Should test for '\\' and '?' following? */
-                  --num[this_unit];
-                  repeat_count = num[this_unit];
-                  /* A bug was fixed here: something got lost in the
-                     translation from BCPL to C -- the line below was
-                     a 'break' which unfortunately broke out of the
-                     enclosing case statement rather than the desired
-                     for-loop! */
-                  /* rely on enclosing for-loop to handle \ and ? correctly! */
-                  goto breaklab;
-
-               default: /* Possible bugfix - what happens on missing cases? */;
+         for (i = 1; i <= need; i++) {
+            if (b + i == e) goto done;         /* carried over to next block */
+            c = b[i];
+            if ((c < (i == 1 ? min2 : 0x80)) || (c > (i == 1 ? max2 : 0xBF))) {
+               valid = FALSE; goto done;
             }
-            if (com[this_unit] == 0) {/* 0 denotes end of command-line. */
-               return (fail_with ("Fallo:", culprit));
-            }
-         }  /* end of seq */
-         breaklab: ;
-      }  /* find () ')' without \ or ? */
-   } /* executing repeats */
+         }
+         if ((size_t)(last - o) <= need) goto done;
+         for (i = 0; i <= need; i++) *o++ = *b++;
+      }
+   }
+ done:
+   *bp = b;
+   *op = o;
+   return valid;
 }
 
-void execute_all (void) {
-   eprompt = ":";
-   this_unit = 0;
-   do {
-      if (!execute_unit()) {
-      	return;
-      }
-      if (IntSeen) {
-        return;
-      }
-      this_unit++;
-   } while (com[this_unit] != 0);
-   ok = TRUE;
+/* Whether utf8_copy() stopped at b in front of a sequence that the end
+   of the block cut short, rather than for want of room */
+static bool utf8_cut_short (const unsigned char *b, const unsigned char *e) {
+   size_t len = (*b < 0xC0) ? 1 : (*b < 0xE0) ? 2 : (*b < 0xF0) ? 3 : 4;
+   return (size_t)(e - b) < len;
 }
+#endif
 
-/* All of the following could be static inlines under GCC, or
-   I might recode some of them as #define'd macros */
+/* Seconds on a clock that only goes forward, for the MB/s reports.
+   clock() would count CPU time: none of the time spent waiting on the
+   disk, and every -jobs thread's at once. */
+static double wall_clock (void) {
+#ifdef HAVE_THREADS
+   struct timespec t;
+   if (clock_gettime (CLOCK_MONOTONIC, &t) == 0) return t.tv_sec + t.tv_nsec / 1e9;
+#endif
+   return (double)clock () / CLOCKS_PER_SEC;   /* the best we have here */
+}
 
-ecce_int case_op (ecce_int sym) {               /* should be made a macro */
-   int chr = sym | casebit;
-#ifdef NEED_TO_REWRITE_THIS_LATER
-   if (isalpha(sym)) { /* this is a flip.  It doesn't yet support %L/%U/%N/%E */
-     if (islower(sym)) {
-       sym = toupper(sym);
-     } else if (isupper(sym)) {
-       sym = tolower(sym);
-     }
+#if defined(WANT_UTF8) && defined(UTF8_BENCHMARK)
+/* Microbenchmark: cc -DWANT_UTF8 -DUTF8_BENCHMARK -o ecce ecce.c
+   then "ecce -utf8-bench fichero" times the old per-character fgetwc()
+   loop against utf8_copy() on the same file and checks that both saw
+   the same number of characters. */
+static void utf8_benchmark (char *fname) {
+   FILE *in = fopen (fname, "rb");
+   unsigned char *bytes;
+   const unsigned char *b;
+   wchar_t *out1;
+   ecce_char *out2;
+   cindex o;
+   wint_t c;
+   long size, n1 = 0L, n2 = 0L;
+   double t, s1, s2;
+
+   if ((in == NULL) || (fseek (in, 0L, SEEK_END) != 0) || ((size = ftell (in)) < 0L)) {
+      fprintf (stderr, "Fichero \"%s\" no encontrado\n", fname);
+      exit (30);
+   }
+   rewind (in);
+   bytes = malloc (size + 1);
+   out1 = malloc ((size + 1) * sizeof(wchar_t));
+   out2 = malloc (size + 1);
+   if ((bytes == NULL) || (out1 == NULL) || (out2 == NULL)
+    || (fread (bytes, 1, size, in) != (size_t)size)) {
+      fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+      exit (40);
+   }
+
+   fclose (in);
+   in = fopen (fname, "rb");   /* fresh stream: the fread() above fixed its orientation */
+   t = wall_clock ();
+   /* (fgetwc) bypasses the byte-I/O macro above and calls the C library */
+   while ((c = (fgetwc) (in)) != WEOF) if (c != '\r') out1[n1++] = c;
+   s1 = wall_clock () - t;
+   fclose (in);
+
+   b = bytes; o = out2;
+   t = wall_clock ();
+   if (!utf8_copy (&b, bytes + size, &o, out2 + size)) {
+      fprintf (stderr, "Secuencia UTF-8 inválida en el byte %ld del fichero\n", (long)(b - bytes));
+   }
+   s2 = wall_clock () - t;
+   while (o != out2) if (!is_cont (*--o)) n2++;
+
+   printf ("fgetwc:    %8.3f s %8.1f MB/s\n", s1, size / (1024.0*1024.0) / (s1 > 0.0 ? s1 : 1e-9));
+   printf ("utf8_copy: %8.3f s %8.1f MB/s\n", s2, size / (1024.0*1024.0) / (s2 > 0.0 ? s2 : 1e-9));
+   printf ("%s\n", (n1 == n2) ? "resultados idénticos" : "LOS RESULTADOS DIFIEREN");
+   exit (0);
+}
+#endif
+
+/* The file is read in blocks of LOAD_BLOCK bytes rather than with one
+   fgetwc() per character.  When the length of the input is known (any
+   ordinary file) the text is decoded straight into its final position
+   at the top of the buffer gap; only input of unknown length, such as
+   a pipe, is gathered at the bottom of the buffer and moved up after. */
+
+#define LOAD_BLOCK (256*1024)
+
+/* Piped input has no known length, so when the text gathered at the
+   bottom of the buffer reaches the top we grow the buffer around it. */
+static bool load_room (cindex *top, cindex *p, cindex *last, size_t n) {
+   bool grown;
+   if (*top != ses->fbeg) return FALSE;  /* the file grew while we read it */
+   ses->pp = *p;
+   grown = make_room (n + 1);
+   *p = ses->pp;
+   ses->pp = ses->fbeg;
+   *top = ses->fbeg;
+   *last = ses->fend - 1;
+   return grown;
+}
+
+#ifdef HAVE_MMAP
+/* -mmap: rather than reading the input into a malloc'd buffer, reserve
+   address space for the biggest buffer we would ever allow and map the
+   file copy-on-write at the very top of it, which is exactly where
+   load_file() would have put the text.  Opening still reads the whole
+   file once (see load_mapped), but nothing is copied unless it has CRs
+   to drop, clean pages can be dropped and read back from the file as
+   memory is wanted, and the file is never written through the
+   mapping.  A buffer that can't be moved can't be realloc'd either,
+   so it starts out at -max-size; the unused gap is address space,
+   not memory.  Don't use it on a file that something else is
+   changing while you edit it. */
+static bool map_buffer (void) {
+   size_t size, region;
+   char *r;
+
+   if ((ses->main_in == stdin) || (fstat (fileno (ses->main_in), &ses->mapped_stat) != 0)
+    || !S_ISREG (ses->mapped_stat.st_mode) || (ses->mapped_stat.st_size <= 0)
+    || ((unsigned long)ses->mapped_stat.st_size >= ses->buffer_limit)) return FALSE;
+   size = (size_t)ses->mapped_stat.st_size;
+   region = ((ses->buffer_limit + 1UL + MAP_ALIGN - 1) / MAP_ALIGN) * MAP_ALIGN;
+   r = mmap (NULL, region, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (r == MAP_FAILED) return FALSE;
+   ses->mapped_at = ((region - 1 - size) / MAP_ALIGN) * MAP_ALIGN;  /* room for a[buffer_size] */
+   if ((ses->mapped_at == 0)
+    || (mmap (r + ses->mapped_at, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED, fileno (ses->main_in), 0) == MAP_FAILED)) {
+      (void)munmap (r, region);
+      return FALSE;
+   }
+   ses->a = r;
+   ses->mapped_region = region;
+   ses->mapped_text = size;
+   ses->buffer_size = ses->mapped_at + size;
+   ses->buffer_limit = ses->buffer_size;
+   ses->min_buffer_size = ses->buffer_size;
+   return TRUE;
+}
+
+/* -window: the buffer is a shared mapping of a spill file, so every
+   page of it can be written out by the kernel instead of taking up
+   memory.  The file goes in the output file's directory, where there
+   ought to be room for another copy of it (/tmp may well be in memory),
+   under a name of mkstemp()'s choosing so that nothing already there is
+   touched, and is removed at once so that it disappears when we exit.
+   Like -mmap the buffer is fixed at -max-size; only the parts in use
+   are on disk. */
+static bool spill_buffer (void) {
+   char *out = ses->parameter[(ses->parameter[T] == NULL) ? F : T];
+   size_t region = ((ses->buffer_limit + 1UL + MAP_ALIGN - 1) / MAP_ALIGN) * MAP_ALIGN;
+   FILE *spill = NULL;
+   char *r;
+
+   if ((strcmp (out, "-") != 0) && (strcmp (out, "/dev/stdout") != 0)) {   /*SYS*/
+      char *slash = strrchr (out, '/');
+      size_t dir = (slash == NULL) ? 0 : (size_t)(slash - out) + 1;
+      char *name = malloc (dir + sizeof(".ecce-spill-XXXXXX"));
+      if (name != NULL) {
+         int fd;
+         (void)memcpy (name, out, dir);
+         (void)strcpy (name + dir, ".ecce-spill-XXXXXX");
+         fd = mkstemp (name);                         /*SYS*/
+         if (fd >= 0) {
+            (void)unlink (name);
+            spill = fdopen (fd, "w+b");
+            if (spill == NULL) close (fd);
+         }
+         free (name);
+      }
+   }
+   if (spill == NULL) spill = tmpfile ();
+   if ((spill == NULL) || (fseek (spill, (long)region - 1L, SEEK_SET) != 0)
+    || (fputc (0, spill) == EOF) || (fflush (spill) != 0)) {
+      fprintf (stderr, "%s: Cuidado - No puedo crear fichero de paginación\n", ProgName);
+      if (spill != NULL) fclose (spill);
+      return FALSE;
+   }
+   r = mmap (NULL, region, PROT_READ | PROT_WRITE, MAP_SHARED, fileno (spill), 0);
+   fclose (spill);   /* the mapping keeps it alive */
+   if (r == MAP_FAILED) return FALSE;
+   ses->a = r;
+   ses->mapped_region = region;
+   ses->buffer_size = region - 1;
+   ses->buffer_limit = ses->buffer_size;
+   ses->min_buffer_size = ses->buffer_size;
+   return TRUE;
+}
+
+/* Let go of the pages from..to, keeping their contents (in the spill
+   file) unless they are part of the gap. */
+static void release (cindex from, cindex to, bool keep) {
+   from = ses->a + ((from - ses->a + MAP_ALIGN - 1) / MAP_ALIGN) * MAP_ALIGN;
+   to = ses->a + ((to - ses->a) / MAP_ALIGN) * MAP_ALIGN;
+   if (from >= to) return;
+   if (keep) {
+      (void)msync (from, to - from, MS_ASYNC);
+      (void)madvise (from, to - from, MADV_DONTNEED);
+      return;
+   }
+#ifdef MADV_REMOVE
+   if (madvise (from, to - from, MADV_REMOVE) == 0) return;  /* frees the disk too */
+#endif
+   (void)madvise (from, to - from, MADV_DONTNEED);
+}
+
+/* Keep only a window's length of text either side of the gap in
+   memory.  Called as the cursor moves a line and between commands,
+   but only does anything once the gap has moved half a window. */
+static void page_out (void) {
+   long half = (long)(ses->window_size / 2UL);
+   cindex end = ses->a + ses->mapped_region;
+
+   if ((ses->paged_pp != NULL) && (labs (ses->pp - ses->paged_pp) < half) && (labs (ses->fp - ses->paged_fp) < half)) return;
+   ses->paged_pp = ses->pp;
+   ses->paged_fp = ses->fp;
+   if ((unsigned long)(ses->pp - ses->a) > ses->window_size) release (ses->a, ses->pp - ses->window_size, TRUE);
+   release (ses->pp, ses->fp, FALSE);
+   if ((unsigned long)(end - ses->fp) > ses->window_size) release (ses->fp + ses->window_size, end, TRUE);
+}
+
+/* The text of a mapped file is already in place, so all that is left
+   is what load_file() would have done on the way in: check it (in the
+   UTF-8 build) and drop CRs.  That means one pass over the whole file,
+   so every page is read in now rather than when the cursor gets to it:
+   dropping CRs later would move text that line counts and pointers
+   already depend on.  Only dropping CRs writes to the mapping, and
+   only if there are any.  Returns the new fp. */
+static cindex load_mapped (void) {
+   cindex start = ses->fend - ses->mapped_text;
+   cindex p, q;
+
+#ifdef WANT_UTF8
+   {
+      static char scratch[LOAD_BLOCK];
+      const unsigned char *b = (unsigned char *)start, *e = b + ses->mapped_text, *was;
+
+      while (b != e) {
+         cindex o = scratch;
+         was = b;
+         if (!utf8_copy (&b, e, &o, scratch + LOAD_BLOCK) || (b == was)) {
+            fprintf (stderr, "Secuencia UTF-8 inválida en el byte %lu del fichero\n",
+                     (unsigned long)(b - (unsigned char *)start));
+            exit (1);
+         }
+      }
+   }
+#endif
+   if (memchr (start, '\r', ses->mapped_text) == NULL) return start;
+   p = q = ses->fend;
+   while (p != start) {
+      if (*--p != '\r') *--q = *p;        /* Ignore CR in CR/LF on DOS/Win */
+   }
+   return q;
+}
+
+/* Before the input file is overwritten - or truncated under us - every
+   page still backed by it has to become ordinary memory, or touching
+   it afterwards would fault.  Only needed when saving to the same file. */
+static bool unmap_file (char *fname) {
+   static char block[LOAD_BLOCK];
+   struct stat st;
+   char *p, *e;
+
+   if (ses->mapped_text == 0UL) return TRUE;
+   if ((stat (fname, &st) != 0) || (st.st_dev != ses->mapped_stat.st_dev)
+    || (st.st_ino != ses->mapped_stat.st_ino)) return TRUE;
+   p = ses->a + ses->mapped_at;
+   e = p + ((ses->mapped_text + MAP_ALIGN - 1) / MAP_ALIGN) * MAP_ALIGN;
+   while (p != e) {
+      size_t n = (e - p > LOAD_BLOCK) ? LOAD_BLOCK : e - p;
+      (void)memcpy (block, p, n);
+      if (mmap (p, n, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) return FALSE;
+      (void)memcpy (p, block, n);
+      p += n;
+   }
+   ses->mapped_text = 0UL;
+   return TRUE;
+}
+#endif
+
+void load_file (void) {
+   char *block;
+   cindex p, top, last;
+   size_t got, carry = 0;  /* bytes of a split UTF-8 sequence held over */
+   long counted = 0L;      /* how much of it line_count has seen */
+   long start, size = -1L;
+   unsigned long loaded = 0UL;
+   double secs, started = wall_clock ();
+
+#ifdef HAVE_MMAP
+   if (ses->mapped_text != 0UL) {
+      fclose (ses->main_in);     /* the mapping outlives the stream */
+      ses->fp = load_mapped ();
+      loaded = ses->mapped_text;
+      ses->line_count = count_lines (ses->fp, ses->fend);
+      goto in_place;
+   }
+#endif
+   if (ses->load_block == NULL) ses->load_block = malloc (LOAD_BLOCK);
+   if (ses->load_block == NULL) {
+      fprintf (ses->tty_out, "Incapaz de referir espacio de almacenamiento\n");
+      percent ('A');
+   }
+   block = ses->load_block;
+   start = ftell (ses->main_in);                             /*SYS*/
+   if ((start >= 0L) && (fseek (ses->main_in, 0L, SEEK_END) == 0)) {
+      size = ftell (ses->main_in) - start;
+      if (fseek (ses->main_in, start, SEEK_SET) != 0) size = -1L;
+   }
+   if ((size >= 0L) && !make_room ((unsigned long)size + 1UL)) {
+      fprintf (ses->tty_out, "* Fichero muy grande!\n");
+      percent ('A');
+   }
+   if (size < 0L) {
+      top = ses->fbeg;
+      last = ses->fend - 1;   /* leave at least one free cell, as before */
+   } else {
+      top = ses->fend - size;
+      last = ses->fend;
+   }
+   p = top;
+
+   while ((got = fread (block + carry, 1, LOAD_BLOCK - carry, ses->main_in)) > 0) {
+#ifdef WANT_UTF8
+      const unsigned char *b = (unsigned char *)block;
+      const unsigned char *e = b + carry + got;
+
+      for (;;) {
+         if (!utf8_copy (&b, e, &p, last)) {
+            fprintf (ses->tty_out, "Secuencia UTF-8 inválida en el byte %lu del fichero\n",
+                     loaded - carry + (unsigned long)(b - (unsigned char *)block));
+            if (ses->embedded) longjmp (ses->bail, ECCE_ABORTED);
+            exit (1);
+         }
+         if ((b == e) || utf8_cut_short (b, e)) break;  /* done, or a split sequence */
+         if ((size >= 0L) || !load_room (&top, &p, &last, e - b)) {   /* only piped input grows */
+            fprintf (ses->tty_out, "* Fichero muy grande!\n");
+            percent ('A');
+         }
+      }
+      loaded += got;
+      carry = e - b;
+      (void)memmove (block, b, carry);
+#else
+      char *b = block, *e = block + got;
+
+      loaded += got;
+      while (b != e) {
+         char *cr = memchr (b, '\r', e - b);  /* Ignore CR in CR/LF on DOS/Win */
+         size_t n = (cr == NULL ? e : cr) - b;
+
+         if ((n > (size_t)(last - p)) && !load_room (&top, &p, &last, n)) {
+            fprintf (ses->tty_out, "* Fichero muy grande!\n");
+            percent ('A');
+         }
+         (void)memcpy (p, b, n);
+         p += n;
+         b += n;
+         if (cr != NULL) b++;
+      }
+#endif
+      ses->line_count += count_lines (top + counted, p);   /* while it's at hand */
+      counted = p - top;
+#ifdef HAVE_MMAP
+      if (ses->window_size != 0UL)  /* send what we've just read on to the spill file */
+         release ((p - top > 2*LOAD_BLOCK) ? p - 2*LOAD_BLOCK : top, p, TRUE);
+#endif
+   }
+#ifdef WANT_UTF8
+   if (carry != 0) {
+      fprintf (ses->tty_out, "Secuencia UTF-8 inválida en el byte %lu del fichero\n",
+               loaded - carry);
+      if (ses->embedded) longjmp (ses->bail, ECCE_ABORTED);
+      exit (1);
+   }
+#endif
+   fclose (ses->main_in);
+
+   /* Only needed for piped input, or when CRs made the text shorter
+      than the file */
+   if (p != ses->fend) (void)memmove (ses->fend - (p - top), top, (p - top) * sizeof(ecce_char));
+   ses->fp = ses->fend - (p - top);
+
+#ifdef HAVE_MMAP
+ in_place:
+#endif
+   ses->lend = ses->fp;
+   while (*ses->lend != '\n')
+      ses->lend++;
+
+   ses->file_bytes = loaded;
+   if (ses->embedded) return;   /* one of many: see batch() */
+   secs = wall_clock () - started;
+   if (secs <= 0.0) secs = 1e-9;
+   fprintf (stderr, "Cargado %lu KBytes en %.3f s (%.1f MB/s)\n",
+            loaded>>10, secs, (double)loaded / (1024.0*1024.0) / secs);
+}
+
+/* Streaming.  With the input on stdin, the text going to stdout and a
+   -command script whose every line only goes on through the text (see
+   forward_only()), the edit doesn't wait for all of the input before it
+   starts, nor keep all of it.  The text starts out empty and is read a
+   block at a time as the commands come to the end of what has been
+   read: stream_ahead() brings in the lines the next command can look
+   at, and a find that runs out of text reads more and goes on.  Each
+   time it reads, the lines before the cursor's are written out and let
+   go, since nothing the script can do will come back to them, so the
+   buffer holds little more than the line in hand, the line a find has
+   got to and the next block.  %C writes whatever is left.  The edit
+   comes out as it would have, except that a bad UTF-8 sequence is only
+   met when the block it is in is read, after some of the text has
+   already gone. */
+
+/* Send the lines before the cursor's on to stdout, and free their room.
+   While U is looking for its text, what it will take out starts at
+   pp_before, which can be a line or more behind: 'holding' keeps that. */
+static void stream_flush (bool holding) {
+   cindex *below[] = { &ses->pp_before, &ses->ms_back, &ses->ml_back, &ses->noted, &ses->ms, &ses->ml, &ses->fp_before };
+   unsigned int i;
+   cindex to;
+   long n;
+
+   settle ();
+   to = ses->lbeg;
+   if (holding && (ses->pp_before != NULL) && (ses->pp_before < to)) to = line_start (ses->pp_before);
+   n = to - ses->fbeg;
+   if (n == 0L) return;
+   if (!write_text (stdout, ses->fbeg, to) || (fflush (stdout) != 0)) {
+      fprintf (stderr, "* Error al escribir \"%s\": %s\n",
+               ses->parameter[(ses->parameter[T] == NULL) ? F : T], strerror (errno));
+      exit (1);
+   }
+   for (i = 0; i < sizeof(below) / sizeof(below[0]); i++) {
+      cindex p = *below[i];
+      if ((p == NULL) || (p >= ses->fp)) continue;
+      *below[i] = ((p < to) || (p > ses->pp)) ? NULL : p - n;   /* gone, or left in the gap */
+   }
+   (void)memmove (ses->fbeg, to, (ses->pp - to) * sizeof(ecce_char));
+   ses->pp -= n;
+   ses->lbeg -= n;
+}
+
+/* Read the next block of the input onto the end of the text, having
+   sent on what is before the cursor's line (see stream_flush() for
+   'holding').  *keep, if given, is a place above the gap to be kept
+   pointing at the same text.  FALSE when there was no more. */
+static bool stream_more (cindex *keep, bool holding) {
+   cindex *above[] = { &ses->lend, &ses->fp_before, &ses->ms, &ses->ml };
+   char *block;
+   long got, n, rest = 0L, kept = 0L;
+   unsigned int i;
+   bool at_end;
+
+   if (ses->stream_in == NULL) return FALSE;
+   stream_flush (holding);
+   if (ses->load_block == NULL) ses->load_block = malloc (LOAD_BLOCK);
+   if (ses->load_block == NULL) {
+      fprintf (ses->tty_out, "Incapaz de referir espacio de almacenamiento\n");
+      percent ('A');
+   }
+   block = ses->load_block;
+#ifdef HAVE_MMAP
+   do {   /* whatever there is, rather than waiting for a whole block */
+      got = read (fileno (ses->stream_in), block + ses->stream_carry, LOAD_BLOCK - ses->stream_carry);   /*SYS*/
+   } while ((got < 0L) && (errno == EINTR));
+#else
+   got = (long)fread (block + ses->stream_carry, 1, LOAD_BLOCK - ses->stream_carry, ses->stream_in);
+#endif
+   if (got <= 0L) {
+#ifdef WANT_UTF8
+      if (ses->stream_carry != 0) {
+         fprintf (ses->tty_out, "Secuencia UTF-8 inválida en el byte %lu del fichero\n",
+                  ses->streamed - ses->stream_carry);
+         exit (1);
+      }
+#endif
+      ses->stream_in = NULL;
+      return FALSE;
+   }
+#ifdef WANT_UTF8
+   {
+      const unsigned char *b = (unsigned char *)block;
+      const unsigned char *e = b + ses->stream_carry + got;
+      cindex o = block;
+
+      if (!utf8_copy (&b, e, &o, block + LOAD_BLOCK)) {   /* in place: it never gets ahead */
+         fprintf (ses->tty_out, "Secuencia UTF-8 inválida en el byte %lu del fichero\n",
+                  ses->streamed - ses->stream_carry + (unsigned long)(b - (unsigned char *)block));
+         exit (1);
+      }
+      n = o - block;
+      rest = (char *)b - block;
+      ses->stream_carry = e - b;
+   }
+#else
+   {
+      char *b = block, *e = block + got, *o = block, *cr;
+
+      while ((cr = memchr (b, '\r', e - b)) != NULL) {   /* Ignore CR in CR/LF on DOS/Win */
+         (void)memmove (o, b, cr - b);
+         o += cr - b;
+         b = cr + 1;
+      }
+      (void)memmove (o, b, e - b);
+      n = (o + (e - b)) - block;
+   }
+#endif
+   ses->streamed += got;
+
+   if (keep != NULL) kept = ses->fend - *keep;
+   if (!make_room ((unsigned long)n)) {
+      fprintf (ses->tty_out, "* Fichero muy grande!\n");
+      percent ('A');
+   }
+   at_end = (ses->lend == ses->fend);
+   (void)memmove (ses->fp - n, ses->fp, (ses->fend - ses->fp) * sizeof(ecce_char));
+   for (i = 0; i < sizeof(above) / sizeof(above[0]); i++) {
+      cindex p = *above[i];
+      if ((p == NULL) || (p <= ses->pp)) continue;
+      *above[i] = (p < ses->fp) ? NULL : p - n;   /* one left in the gap could land on the text */
+   }
+   ses->fp -= n;
+   (void)memcpy (ses->fend - n, block, n * sizeof(ecce_char));
+   if (at_end) ses->lend = line_end (ses->fend - n);
+   if (ses->stream_carry != 0) (void)memmove (block, block + rest, ses->stream_carry);
+   ses->line_count += count_lines (ses->fend - n, ses->fend);
+   if (keep != NULL) *keep = ses->fend - n - kept;
+   return TRUE;
+}
+
+/* Have the cursor's line and the lines-1 after it all read, or as
+   many of them as the input has */
+static void stream_lines (long lines) {
+   cindex p;
+   long n;
+
+   do {
+      (void) ahead ();   /* for lend above the gap */
+      if (ses->lend != ses->fend) {
+         p = ses->lend + 1;
+         for (n = lines - 1L; n > 0L; n--) {
+            p = memchr (p, '\n', ses->fend - p);
+            if (p == NULL) break;
+            p++;
+         }
+         if (n <= 0L) return;
+      }
+   } while (stream_more (NULL, FALSE));
+}
+
+/* Read the rest of the input, taking the cursor on to the start of
+   the last line each time so that what it passes can go */
+static void stream_to_end (void) {
+   cindex nl;
+
+   while (ses->stream_in != NULL) {
+      nl = scan_last (ahead (), ses->fend, '\n', 0);
+      if (nl != NULL) cursor_to (nl + 1);
+      (void) stream_more (NULL, FALSE);
+   }
+}
+
+/* What the command about to be obeyed can look at: the rest of the
+   cursor's line, and for M, K, J and P the lines after it as well */
+static void stream_ahead (void) {
+   long lines = 1L;
+
+   switch (ses->command & ~plusbit) {
+      case 'M':
+         if (ses->repeat_count == 0L) {
+            stream_to_end ();
+            return;
+         }
+         /* fall through */
+      case 'K':
+      case 'J':
+      case 'P':
+         lines = (ses->repeat_count > 1L) ? ses->repeat_count + 1L : 2L;
+         break;
+   }
+   stream_lines (lines);
+}
+
+/* Whether a forward search, which found q or gave up at stop, has to
+   wait for more of the input: it has run into the end of what has been
+   read, or found its match in a line that hasn't all come in yet, where
+   the rest of the line could hold an earlier match that is longer */
+static bool stream_short (cindex q, cindex stop) {
+   if (ses->stream_in == NULL) return FALSE;
+   if (q == NULL) return (stop == ses->fend);
+   return (memchr (q, '\n', ses->fend - q) == NULL);
+}
+
+/* ... in which case, let go of what the search from 'at' has been
+   over and read some more: the cursor goes on to the start of the last
+   line the search got to, if 'move' allows it, and the search's line
+   limit counts down the lines it has passed.  Where the search is to
+   go on from. */
+static cindex stream_past (cindex at, cindex q, long *lines, bool move) {
+   cindex nl = scan_last (at, ses->fend, '\n', 0);
+   long m = 4L * (long)text_length (ses->pointer);   /* a match is at most 4 bytes a character */
+
+   if (nl != NULL) {
+      if (*lines > 0L) *lines -= count_lines (at, nl + 1);
+      at = nl + 1;
+      if (move) {
+         cursor_to (at);
+         ses->ms = NULL;
+      }
+   }
+   if ((q == NULL) && (ses->fend - at > m)) at = ses->fend - m;   /* nothing starts before that */
+   (void) stream_more (&at, !move);
+   return at;
+}
+
+bool execute_unit (void) {
+   ecce_int culprit;
+
+   ses->command = ses->com[ses->this_unit];
+   culprit = ses->command;
+   ses->pointer = ses->link[ses->this_unit];
+
+   ses->repeat_count = ses->num[ses->this_unit];
+   for (;;) {  /* On repeats of this_unit */
+      if (IntSeen) {
+        return (ses->ok = FALSE);
+      }
+      if (ses->stream_in != NULL) stream_ahead ();
+      execute_command ();
+      if (ses->tracking && (strchr (lazy_commands, ses->command & (~plusbit)) == NULL)) note_gap ();
+      --ses->repeat_count;
+      if (ses->ok) {
+         if (ses->repeat_count == 0L || ses->repeat_count == ses->stopper) {
+           return (ses->ok);
+         }
+         continue;
+      }
+      ses->ok = TRUE;
+      for (;;) {  /* scanning for end of unit (e_g_ ')') */
+         if (IntSeen) {
+           return (ses->ok = FALSE);
+         }
+         if (ses->repeat_count < 0L ) {
+           if (ses->com[ses->this_unit+1] == '\\') {
+              ses->this_unit++;
+              return (ses->ok = FALSE);
+           }
+           return (ses->ok);
+         }
+         if ((ses->com[ses->this_unit+1] == '\\') || (ses->com[ses->this_unit+1] == '?')) {
+            ses->this_unit++;
+            return (ses->ok);
+         }
+         /* indefinite repetition never fails */
+         /* analyse() has worked out where the scan for the end of the
+            sequence stops, passing over (...) as if it were a single
+            command */
+         ses->this_unit = ses->fail_to[ses->this_unit];
+         if (ses->com[ses->this_unit] == ',') return (ses->ok);
+         if (ses->com[ses->this_unit] == 0) {/* 0 denotes end of command-line. */
+            return (fail_with ("Fallo:", culprit));
+         }
+         /* ')': rely on enclosing for-loop to handle \ and ? correctly! */
+         --ses->num[ses->this_unit];
+         ses->repeat_count = ses->num[ses->this_unit];
+      }  /* find () ')' without \ or ? */
+   } /* executing repeats */
+}
+
+void execute_all (void) {
+   ses->eprompt = ":";
+   ses->this_unit = 0;
+   do {
+      if (!execute_unit()) {
+      	return;
+      }
+      if (IntSeen) {
+        return;
+      }
+      ses->this_unit++;
+   } while (ses->com[ses->this_unit] != 0);
+   ses->ok = TRUE;
+}
+
+/* Keep a copy of the command line just analysed */
+static bool save_program (struct program *pr) {
+   pr->units = ses->max_unit + 2;   /* and the ')' and 0 after it */
+   pr->last = ses->max_unit;
+   pr->coms = malloc (pr->units * sizeof(ecce_int));
+   pr->links = malloc (pr->units * sizeof(int));
+   pr->fails = malloc (pr->units * sizeof(int));
+   pr->nums = malloc (pr->units * sizeof(long));
+   pr->lims = malloc (pr->units * sizeof(long));
+   pr->idioms = malloc (pr->units * sizeof(char));
+   pr->texts = malloc ((Max_command_units+1) * sizeof(ecce_char));
+   if ((pr->coms == NULL) || (pr->links == NULL) || (pr->fails == NULL) || (pr->nums == NULL)
+    || (pr->lims == NULL) || (pr->idioms == NULL) || (pr->texts == NULL)) {
+      free_program (pr);
+      return FALSE;
+   }
+   (void)memcpy (pr->coms, ses->com, pr->units * sizeof(ecce_int));
+   (void)memcpy (pr->links, ses->link, pr->units * sizeof(int));
+   (void)memcpy (pr->fails, ses->fail_to, pr->units * sizeof(int));
+   (void)memcpy (pr->nums, ses->num, pr->units * sizeof(long));
+   (void)memcpy (pr->lims, ses->lim, pr->units * sizeof(long));
+   (void)memcpy (pr->idioms, ses->idiom, pr->units * sizeof(char));
+   (void)memcpy (pr->texts, ses->text, (Max_command_units+1) * sizeof(ecce_char));
+   return TRUE;
+}
+
+/* ... and put it back, into this session's tables */
+static void load_program (struct program *pr) {
+   int u;
+
+   (void)memcpy (ses->com, pr->coms, pr->units * sizeof(ecce_int));
+   (void)memcpy (ses->link, pr->links, pr->units * sizeof(int));
+   (void)memcpy (ses->fail_to, pr->fails, pr->units * sizeof(int));
+   (void)memcpy (ses->num, pr->nums, pr->units * sizeof(long));
+   (void)memcpy (ses->lim, pr->lims, pr->units * sizeof(long));
+   (void)memcpy (ses->idiom, pr->idioms, pr->units * sizeof(char));
+   (void)memcpy (ses->text, pr->texts, (Max_command_units+1) * sizeof(ecce_char));
+   for (u = 0; u < pr->units; u++) ses->skip_for[u] = -1;
+   ses->max_unit = pr->last;
+}
+
+static void free_program (struct program *pr) {
+   free (pr->coms); free (pr->links); free (pr->fails); free (pr->nums);
+   free (pr->lims); free (pr->idioms); free (pr->texts);
+   pr->coms = NULL; pr->links = NULL; pr->fails = NULL; pr->nums = NULL;
+   pr->lims = NULL; pr->idioms = NULL; pr->texts = NULL;
+}
+
+/* What -server and -diff send is the part of the text that has changed:
+   since the start, or since the last answer.  Commands change the text
+   only at the gap, so where the gap stands as each one starts and
+   finishes bounds what it can have changed, and note_gap() keeps the
+   least seen at either end, or -1 if nothing that could change the
+   text has been obeyed.  A secondary context (%S) leaves the main text
+   alone, so it isn't watched. */
+static void note_gap (void) {
+   long head = ses->pp - ses->fbeg, tail = ses->fend - ses->fp;
+
+   if (ses->in_second) return;
+   if ((ses->same_head < 0L) || (head < ses->same_head)) ses->same_head = head;
+   if ((ses->same_tail < 0L) || (tail < ses->same_tail)) ses->same_tail = tail;
+}
+
+/* Bytes *from to *from + *gone of the text as it was have become
+   *from to *from + *n of the text now */
+static void changed_part (long *from, long *gone, long *n) {
+   *from = *gone = *n = 0L;
+   if (ses->same_head < 0L) return;
+   *from = ses->same_head;
+   *gone = ses->same_len - ses->same_tail - ses->same_head;
+   *n = (ses->pp - ses->fbeg) + (ses->fend - ses->fp) - ses->same_tail - ses->same_head;
+}
+
+/* Byte 'off' of the text, wherever the gap is */
+static cindex text_at (long off) {
+   return (off <= ses->pp - ses->fbeg) ? ses->fbeg + off : ses->fp + (off - (ses->pp - ses->fbeg));
+}
+
+/* -diff: what %C writes in place of the text, a patch to the file as
+   it was read:
+
+      <offset> <deleted> <inserted>
+
+   and then the <inserted> bytes that take the place of <deleted>
+   bytes from <offset>, all counted in bytes from 0 */
+static bool write_patch (FILE *f) {
+   long from, gone, n;
+
+   changed_part (&from, &gone, &n);
+   if (fprintf (f, "%ld %ld %ld\n", from, gone, n) < 0) return FALSE;
+   return write_text (f, text_at (from), text_at (from + n));
+}
+
+/* The command lines in 'lines', as main() would obey them */
+static void obey_commands (char *lines) {
+   ses->commandp = lines;
+   for (;;) {
+      while ((*ses->commandp == '\n') || (*ses->commandp == ';') || (*ses->commandp == ' ')) ses->commandp++;
+      if (*ses->commandp == '\0') break;
+      obey_line ();
+      if (ses->commandp == NULL) break;
+   }
+   ses->commandp = NULL;
+}
+
+#ifndef ECCE_LIBRARY
+/* -server: instead of being started afresh over the whole text for
+   every command, ecce stays up with the text loaded and is sent
+   requests on stdin, answering each on stdout.  A request is a line
+
+      <verb> <length> <version>
+
+   followed by exactly <length> bytes.  The verbs are
+
+      c   obey the bytes as command lines, as -command would
+      t   the bytes are the text from now on, with the cursor at the start
+      g   send the text back
+      s   send a checksum of the text back
+      q   stop, without saving
+
+   <version> may be left out.  If it is given with c and isn't the
+   current version, nothing is obeyed: the client has lost step and
+   should send the text again with t.  The answer to c or t is
+
+      = <version> <point> <out> <from> <to> <new>
+
+   followed by <out> bytes of what ecce printed (P, failures and so on)
+   and then <new> bytes to replace bytes <from> to <to> of the text as
+   it was at the last answer.  Offsets count bytes from 0, <point> too,
+   and the version goes up whenever the text changes.  g is answered by
+   "T <version> <length>" and the text, s by "S <version> <checksum>",
+   and a request that can't be done by "! <reason>".  %C, %c and %A
+   still end the edit, and the server with it, without an answer.
+ */
+
+/* Bytes from..to of the text to stdout, in at most two pieces */
+static void put_text (long from, long to) {
+   long below = ses->pp - ses->fbeg;
+
+   if (from < below) {
+      (void)fwrite (ses->fbeg + from, sizeof(ecce_char), ((to < below) ? to : below) - from, stdout);
+      from = below;
+   }
+   if (from < to) (void)fwrite (ses->fp + (from - below), sizeof(ecce_char), to - from, stdout);
+}
+
+static void answer (void) {
+   long from, gone, n, out = ftell (ses->tty_out), at;
+   char chunk[4096];
+   size_t got;
+
+   changed_part (&from, &gone, &n);
+   if ((gone != 0L) || (n != 0L)) ses->served_version++;
+   if (ses->cursor == NULL) at = ses->pp - ses->fbeg;
+   else if (ses->cursor < ses->pp) at = ses->cursor - ses->fbeg;
+   else at = (ses->pp - ses->fbeg) + (ses->cursor - ses->fp);
+   fprintf (stdout, "= %ld %ld %ld %ld %ld %ld\n", ses->served_version, at, out, from, from + gone, n);
+   rewind (ses->tty_out);
+   for (; out > 0L; out -= got) {
+      got = fread (chunk, 1, (out < (long)sizeof chunk) ? (size_t)out : sizeof chunk, ses->tty_out);
+      if (got == 0) break;
+      (void)fwrite (chunk, 1, got, stdout);
+   }
+   rewind (ses->tty_out);
+   put_text (from, from + n);
+   (void)fflush (stdout);
+   ses->same_len = (ses->pp - ses->fbeg) + (ses->fend - ses->fp);
+   ses->same_head = ses->same_tail = -1L;
+}
+
+static void refuse (char *why) {
+   fprintf (stdout, "! %s\n", why);
+   (void)fflush (stdout);
+}
+
+/* The rest of a request that isn't wanted */
+static void skip_request (long n) {
+   while ((n-- > 0L) && (getc (stdin) != EOF)) ;
+}
+
+static void serve (void) {
+   char head[80], verb;
+   long n, version, len, k;
+   unsigned long sum;
+   char *request;
+   bool refused;
+
+   ses->tty_out = tmpfile ();   /* gathers what is printed, for the answer */
+   if (ses->tty_out == NULL) {
+      fprintf (stderr, "%s: -server necesita un fichero temporal: %s\n", ProgName, strerror (errno));
+      exit (1);
+   }
+   for (;;) {
+      if (fgets (head, sizeof head, stdin) == NULL) break;   /* the client has gone */
+      version = ses->served_version;
+      if ((sscanf (head, "%c %ld %ld", &verb, &n, &version) < 2) || (n < 0L)) {
+         refuse ("Petición");
+         continue;
+      }
+      switch (verb) {
+
+         case 'c':
+            request = malloc (n + 1);
+            if (request == NULL) {
+               skip_request (n);
+               refuse ("Sin espacio");
+               break;
+            }
+            if ((long)fread (request, 1, n, stdin) != n) {
+               free (request);
+               continue;   /* cut short: the next fgets() sees the end */
+            }
+            request[n] = '\0';
+            if (version != ses->served_version) {
+               free (request);
+               fprintf (stdout, "! Versión %ld\n", ses->served_version);
+               (void)fflush (stdout);
+               break;
+            }
+            obey_commands (request);
+            free (request);
+            answer ();
+            break;
+
+         case 't':
+            if ((unsigned long)n > ses->buffer_limit) {
+               skip_request (n);
+               refuse ("Sin espacio");
+               break;
+            }
+            ses->cursor = NULL;
+            ses->pp = ses->fbeg;
+            ses->fp = ses->fend;
+            refused = !make_room ((unsigned long)n);
+            if (refused) {   /* the old text is gone all the same, which the version says */
+               skip_request (n);
+               refuse ("Sin espacio");
+               n = 0L;
+            } else {
+               ses->fp = ses->fend - n;
+               if ((long)fread (ses->fp, 1, n, stdin) != n) continue;
+            }
+            ses->lbeg = ses->pp;
+            ses->lend = line_end (ses->fp);
+            ses->line_no = 0L;
+            ses->line_count = count_lines (ses->fp, ses->fend);
+            ses->ms = ses->ms_back = ses->ml = ses->ml_back = NULL;
+            ses->pp_before = ses->fp_before = NULL;
+            ses->noted = NULL;
+            ses->served_version++;
+            ses->same_len = n;
+            ses->same_head = ses->same_tail = -1L;
+            if (!refused) answer ();   /* one reply to each request */
+            break;
+
+         case 'g':
+            skip_request (n);
+            len = (ses->pp - ses->fbeg) + (ses->fend - ses->fp);
+            fprintf (stdout, "T %ld %ld\n", ses->served_version, len);
+            put_text (0L, len);
+            (void)fflush (stdout);
+            break;
+
+         case 's':   /* 32 bit FNV-1a */
+            skip_request (n);
+            sum = 2166136261UL;
+            len = (ses->pp - ses->fbeg) + (ses->fend - ses->fp);
+            for (k = 0L; k < len; k++) {
+               sum = ((sum ^ (unsigned char)((k < ses->pp - ses->fbeg) ? ses->fbeg[k] : ses->fp[k - (ses->pp - ses->fbeg)])) * 16777619UL) & 0xFFFFFFFFUL;
+            }
+            fprintf (stdout, "S %ld %08lx\n", ses->served_version, sum);
+            (void)fflush (stdout);
+            break;
+
+         case 'q':
+            free_buffers ();
+            exit (0);
+
+         default:
+            skip_request (n);
+            refuse ("Verbo");
+      }
+   }
+   free_buffers ();
+   exit (0);
+}
+
+/* -batch: the same -command for every file named in a list, as though
+   ecce had been run on each in turn, but with the command analysed only
+   once and the files shared out among -jobs threads.  Each thread keeps
+   one session, and its buffer, from file to file.  The script is kept
+   as the steps analyse() made of its lines, and a %C or %A in it ends a
+   file's edit.  After %C the text goes to a new file, which then takes
+   the old one's name, so that nobody sees a file half written.  %S, %W
+   and G need more than the script and the text, so they aren't allowed.
+   What became of each file goes to stdout, in the order of the list,
+   and the totals to stderr. */
+
+struct batch_step {
+   int percent;           /* a % command's letter, or 0 for a command line */
+   bool onward;           /* the line would do for streaming: see forward_only() */
+   struct program prog;
+};
+
+struct batch_file {
+   char *name;
+   int outcome;           /* as ecce_run() would say, or -1 if it couldn't be read or written */
+   int error;             /* errno then */
+   long failed;           /* how many failures there were */
+   unsigned long bytes;   /* how big it was */
+};
+
+static struct batch_step *steps = NULL;
+static int step_count = 0;
+static struct batch_file *batch_files = NULL;
+static long batch_count = 0L, batch_next = 0L;
+static unsigned long batch_size, batch_limit;   /* -size and -max-size, or 0 */
+#ifdef HAVE_THREADS
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Analyse the script, line by line, into steps[], allowing only the %
+   commands in 'percents'.  'quietly' leaves saying what is wrong with
+   it to whoever runs it. */
+static bool compile_script (char *script, const char *percents, bool quietly) {
+   struct batch_step *st;
+   char *p;
+   int u;
+
+   ses->embedded = TRUE;   /* the end of the script ends the line */
+   ses->commandp = script;
+   for (;;) {
+      while ((*ses->commandp == '\n') || (*ses->commandp == ';') || (*ses->commandp == ' ')) ses->commandp++;
+      if (*ses->commandp == '\0') break;
+      st = realloc (steps, (step_count + 1) * sizeof(struct batch_step));
+      if (st == NULL) return FALSE;
+      steps = st;
+      st = &steps[step_count++];
+      (void)memset (st, 0, sizeof(struct batch_step));
+      if (*ses->commandp == '%') {
+         for (p = ses->commandp + 1; *p == ' '; p++) ;
+         st->percent = (('a' <= *p) && (*p <= 'z')) ? (*p - casebit) : *p;
+         if ((st->percent == '\0') || (strchr (percents, st->percent) == NULL)) {
+            if (!quietly) fprintf (stderr, "%s: %%%c no está permitido con -batch\n", ProgName, *p);
+            return FALSE;
+         }
+         while ((*ses->commandp != '\0') && (*ses->commandp != '\n') && (*ses->commandp != ';')) ses->commandp++;
+         continue;
+      }
+      if (!analyse ()) return FALSE;   /* it has said why */
+      for (u = 0; u <= ses->max_unit; u++) {
+         if (((ses->com[u] & ~plusbit) | casebit) == 'g') {
+            if (!quietly) fprintf (stderr, "%s: G no está permitido con -batch\n", ProgName);
+            return FALSE;
+         }
+      }
+      st->onward = ses->forward;
+      if (!save_program (&st->prog)) return FALSE;
+      if (ses->commandp == NULL) break;
+   }
+   return TRUE;
+}
+
+/* Whether the edit can stream (see stream_more()): the text comes from
+   stdin and goes to stdout, and the script goes only forward and ends
+   in %C.  The script is analysed here once beforehand, to see, and
+   whatever it has to say about itself is left until it is obeyed. */
+static bool streamable (void) {
+   char *script = ses->commandp, *out = ses->parameter[(ses->parameter[T] == NULL) ? F : T];
+   FILE *said = ses->tty_out, *logged = ses->log_out;
+   bool fine, ends = FALSE;
+   int i;
+
+   if ((ses->main_in != stdin) || (script == NULL) || ses->tracking || (ses->cursor_file != NULL)
+    || ((strcmp (out, "-") != 0) && (strcmp (out, "/dev/stdout") != 0))) return FALSE;   /*SYS*/
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) return FALSE;
+#endif
+   ses->tty_out = fopen ("/dev/null", "wb");   /*SYS*/
+   if (ses->tty_out == NULL) ses->tty_out = fopen ("NUL:", "wb");
+   if (ses->tty_out == NULL) {
+      ses->tty_out = said;
+      return FALSE;
+   }
+   ses->log_out = NULL;
+   fine = compile_script (script, "LUNEVC", TRUE);
+   for (i = 0; i < step_count; i++) {
+      if (steps[i].percent == 'C') ends = TRUE;
+      else if (!ends && (steps[i].percent == 0) && !steps[i].onward) fine = FALSE;
+      free_program (&steps[i].prog);
+   }
+   free (steps);
+   steps = NULL;
+   step_count = 0;
+   fclose (ses->tty_out);
+   ses->tty_out = said;
+   ses->log_out = logged;
+   ses->embedded = FALSE;   /* and back to the start, to be obeyed */
+   ses->commandp = script;
+   ses->pending_sym = '\n';
+   ses->blank_line = TRUE;
+   ses->max_unit = -1;
+   ses->failures = 0L;
+   return fine && ends;
+}
+
+/* Write the text to a new file beside 'name', which then replaces it.
+   On unix mkstemp() makes the new file, so that nothing already there
+   under a guessable name is overwritten or followed. */
+static bool save_file (char *name, int worker) {
+   char *tmp = malloc (strlen (name) + 40);
+   FILE *f;
+   bool done;
+   int error;
+#ifdef HAVE_MMAP
+   struct stat st;
+   int fd;
+#endif
+
+   if (tmp == NULL) return FALSE;
+#ifdef HAVE_MMAP
+   (void)worker;
+   sprintf (tmp, "%s.eccXXXXXX", name);
+   fd = mkstemp (tmp);                                      /*SYS*/
+   f = (fd < 0) ? NULL : fdopen (fd, "wb");
+   if ((f == NULL) && (fd >= 0)) {
+      error = errno;
+      close (fd);
+      (void)remove (tmp);
+      errno = error;
+   }
+#else
+   sprintf (tmp, "%s.ecce%d~", name, worker);
+   f = fopen (tmp, "wb");
+#endif
+   if (f == NULL) {
+      free (tmp);
+      return FALSE;
+   }
+   done = write_text (f, ses->fbeg, ses->fend);
+#ifdef HAVE_MMAP
+   if (done && (stat (name, &st) == 0)) (void)fchmod (fd, st.st_mode & 07777);
+#endif
+   if (fclose (f) != 0) done = FALSE;
+   if (done && (rename (tmp, name) != 0)) done = FALSE;   /*SYS* Windows won't rename over a file */
+   if (!done) {
+      error = errno;
+      (void)remove (tmp);
+      errno = error;
+   }
+   free (tmp);
+   return done;
+}
+
+/* One file, start to finish */
+static void batch_edit (struct batch_file *f, int worker) {
+   volatile bool loading = TRUE;
+   long size = -1L;
+   int outcome, k;
+
+   f->outcome = -1;
+   ses->main_in = fopen (f->name, "rb");
+   if (ses->main_in == NULL) {
+      f->error = errno;
+      return;
+   }
+   if (fseek (ses->main_in, 0L, SEEK_END) == 0) size = ftell (ses->main_in);   /*SYS*/
+   rewind (ses->main_in);
+   f->bytes = (size < 0L) ? 0UL : (unsigned long)size;
+
+   /* What main() would have started with for this file, in the buffer
+      that the last one left */
+   ses->buffer_limit = batch_limit;
+   if (ses->buffer_limit == 0UL) ses->buffer_limit = (f->bytes + 1024UL*256UL) * 4UL + 64UL*1024UL*1024UL;
+   ses->stopper = 0 - 3L * (long)((batch_size != 0UL) ? batch_size : f->bytes + 1024UL*256UL);
+   ses->cursor = NULL;
+   ses->pp = ses->fbeg;
+   ses->fp = ses->fend;
+   if (ses->buffer_size > ses->buffer_limit) (void)resize_buffer (ses->min_buffer_size);
+   ses->lbeg = ses->fbeg;
+   ses->lend = ses->fend;
+   ses->line_no = ses->line_count = 0L;
+   ses->ms = ses->ms_back = ses->ml = ses->ml_back = NULL;
+   ses->pp_before = ses->fp_before = NULL;
+   ses->noted = NULL;
+   ses->changes = 0;
+   ses->pending_sym = '\n';
+   ses->blank_line = TRUE;
+   ses->failures = 0L;
+   ses->ok = TRUE;
+   select_case ('E');
+
+   outcome = setjmp (ses->bail);
+   if (outcome == 0) {
+      load_file ();
+      loading = FALSE;
+      outcome = ECCE_OK;   /* if the script doesn't end the edit, the file stays as it was */
+      for (k = 0; k < step_count; k++) {
+         if (steps[k].percent == 'C') {
+            outcome = ECCE_DONE;
+            break;
+         }
+         if (steps[k].percent == 'A') {
+            outcome = ECCE_ABORTED;
+            break;
+         }
+         if (steps[k].percent != 0) {
+            if (strchr ("LUNE", steps[k].percent) != NULL) select_case (steps[k].percent);
+            continue;   /* %I and %V would only print */
+         }
+         load_program (&steps[k].prog);
+         ses->pending_sym = '\n';
+         execute_all ();
+      }
+   } else if (loading) {
+      fclose (ses->main_in);
+   }
+   f->outcome = outcome;
+   f->failed = ses->failures;
+   if ((outcome == ECCE_DONE) && !save_file (f->name, worker)) {
+      f->outcome = -1;
+      f->error = errno;
+   }
+}
+
+/* Take files from the list until there are none left */
+static void *batch_worker (void *arg) {
+   int worker = (int)(long)arg;
+   long i;
+
+   if (!new_session ()) return NULL;
+   ses->embedded = ses->quiet = TRUE;
+   ses->tty_out = fopen ("/dev/null", "wb");   /*SYS*/
+   if (ses->tty_out == NULL) ses->tty_out = fopen ("NUL:", "wb");
+   ses->buffer_size = (batch_size != 0UL) ? batch_size : LOAD_BLOCK;
+   if ((batch_limit != 0UL) && (ses->buffer_size > batch_limit)) ses->buffer_size = batch_limit;
+   ses->min_buffer_size = ses->buffer_limit = ses->buffer_size;
+   if ((ses->tty_out != NULL) && init_globals ()) {
+      ses->a[0]                = '\n';
+      ses->a[ses->buffer_size] = '\n';
+      for (;;) {
+#ifdef HAVE_THREADS
+         (void)pthread_mutex_lock (&batch_lock);
+#endif
+         i = batch_next++;
+#ifdef HAVE_THREADS
+         (void)pthread_mutex_unlock (&batch_lock);
+#endif
+         if (i >= batch_count) break;
+         batch_edit (&batch_files[i], worker);
+      }
+   }
+   if (ses->tty_out != NULL) fclose (ses->tty_out);
+   end_session ();
+   return NULL;
+}
+
+static void batch (char *list) {
+   FILE *in;
+   char name[Max_parameter+2], *nl;
+   long i, done = 0L;
+   unsigned long bytes = 0UL;
+   double started, secs;
+   int t;
+
+   ses->tty_out = stderr;
+   batch_size = ses->buffer_size;
+   batch_limit = ses->buffer_limit;
+   ses->buffer_size = ses->min_buffer_size = ses->buffer_limit = LOAD_BLOCK;   /* only for analysing */
+   if (!init_globals ()) {
+      fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+      exit (40);
+   }
+   if (!compile_script (ses->commandp, "LUNEIVCA", FALSE)) exit (1);
+
+   in = (strcmp (list, "-") == 0) ? stdin : fopen (list, "r");   /*SYS*/
+   if (in == NULL) {
+      fprintf (stderr, "Fichero \"%s\" no encontrado\n", list);
+      exit (30);
+   }
+   while (fgets (name, sizeof name, in) != NULL) {
+      nl = strpbrk (name, "\r\n");
+      if (nl != NULL) *nl = '\0';
+      if (name[0] == '\0') continue;
+      if ((batch_count & (batch_count - 1)) == 0) {   /* 0, 1, 2, 4, ... */
+         struct batch_file *more = realloc (batch_files, (batch_count ? batch_count * 2 : 1) * sizeof(struct batch_file));
+         if (more == NULL) {
+            fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+            exit (40);
+         }
+         batch_files = more;
+      }
+      batch_files[batch_count].name = malloc (strlen (name) + 1);
+      if (batch_files[batch_count].name == NULL) {
+         fprintf (stderr, "Incapaz de referir espacio de almacenamiento\n");
+         exit (40);
+      }
+      strcpy (batch_files[batch_count].name, name);
+      batch_files[batch_count].outcome = -1;
+      batch_files[batch_count].error = ENOMEM;   /* if no worker ever gets to it */
+      batch_files[batch_count].failed = 0L;
+      batch_files[batch_count].bytes = 0UL;
+      batch_count++;
+   }
+   if (in != stdin) fclose (in);
+
+   started = wall_clock ();
+#ifdef HAVE_THREADS
+   if (ses->jobs > batch_count) ses->jobs = (int)batch_count;
+   if (ses->jobs > 1) {
+      pthread_t *worker = malloc (ses->jobs * sizeof(pthread_t));
+      int started_ok = 0;
+      if (worker != NULL) {
+         for (t = 0; t < ses->jobs; t++) {
+            if (pthread_create (&worker[started_ok], NULL, batch_worker, (void *)(long)t) == 0) started_ok++;
+         }
+         for (t = 0; t < started_ok; t++) (void)pthread_join (worker[t], NULL);
+         free (worker);
+      }
+   }
+#endif
+   free_buffers ();                   /* done with analysing: this thread is a worker now */
+   (void)batch_worker ((void *)0L);   /* whatever is left: all of it, with one job */
+   secs = wall_clock () - started;
+
+   for (i = 0L; i < batch_count; i++) {
+      struct batch_file *f = &batch_files[i];
+      bytes += f->bytes;
+      switch (f->outcome) {
+         case ECCE_DONE:
+            done++;
+            if (f->failed == 0L) printf ("%s: hecho\n", f->name);
+            else printf ("%s: hecho, con %ld fallos\n", f->name, f->failed);
+            break;
+         case ECCE_ABORTED:
+            printf ("%s: abortado\n", f->name);
+            break;
+         case -1:
+            printf ("%s: %s\n", f->name, strerror (f->error));
+            break;
+         default:
+            printf ("%s: sin %%C, sin cambios\n", f->name);
+      }
+   }
+   (void)fflush (stdout);
+   if (secs <= 0.0) secs = 1e-6;
+   fprintf (stderr, "%ld ficheros, %ld hechos, %lu KBytes en %.3f s (%.1f ficheros/s, %.1f MB/s)\n",
+            batch_count, done, bytes>>10, secs, batch_count / secs, (double)bytes / (1024.0*1024.0) / secs);
+   exit ((done == batch_count) ? 0 : 1);
+}
+#endif
+
+#ifdef ECCE_LIBRARY
+/* Built with -DECCE_LIBRARY there is no main(), and ecce is instead a
+   library for editing text in the caller's own memory:
+
+      struct ecce_session *ecce_open (char *buf, size_t len, size_t size, FILE *out);
+      int ecce_run (struct ecce_session *s, char *commands);
+      void ecce_text (struct ecce_session *s, char **first, size_t *first_len,
+                      char **second, size_t *second_len);
+      void ecce_close (struct ecce_session *s);
+
+   The text is the len bytes from buf[1], and ecce uses buf[0] and the
+   rest of the size bytes as it goes, without copying it: but nor can it
+   grow any bigger, so an insertion that won't fit fails as it would at
+   -max-size.  ecce_run() obeys command lines as -command would, printing
+   to out (if it isn't NULL), and answers ECCE_OK, ECCE_FAILED if a
+   command failed, or ECCE_DONE or ECCE_ABORTED once %C or %A has ended
+   the edit.  %W, which would write a file, fails instead.  The text is
+   then whatever lies either side of the gap, which ecce_text() points
+   at, still in buf.  A session can be used by only one thread at a time,
+   but different threads can use different sessions. */
+
+struct ecce_session *ecce_open (char *buf, size_t len, size_t size, FILE *out) {
+   struct ecce_session *was = ses, *s;
+
+   if ((buf == NULL) || (size < len + 2)) return NULL;
+   if (!new_session ()) {
+      ses = was;
+      return NULL;
+   }
+   s = ses;
+   ses->embedded = ses->borrowed = TRUE;
+   ses->a = buf;
+   ses->buffer_size = ses->min_buffer_size = ses->buffer_limit = size - 1;
+   ses->tty_out = out;
+   if (ses->tty_out == NULL) {
+      ses->tty_out = fopen ("/dev/null", "wb");   /*SYS*/
+      if (ses->tty_out == NULL) ses->tty_out = fopen ("NUL:", "wb");
+      ses->quiet = TRUE;
+   }
+   if ((ses->tty_out == NULL) || !init_globals ()) {
+      if (ses->quiet && (ses->tty_out != NULL)) fclose (ses->tty_out);
+      free (s);
+      ses = was;
+      return NULL;
+   }
+   ses->a[0]                = '\n';
+   ses->a[ses->buffer_size] = '\n';
+   ses->pp = ses->fbeg + len;   /* all below the gap, as it was given */
+   ses->line_count = ses->line_no = count_lines (ses->fbeg, ses->pp);
+   ses->lbeg = line_start (ses->pp);
+   cursor_to_start ();   /* which leaves the gap where it is */
+   select_case ('E');
+   ses = was;
+   return s;
+}
+
+int ecce_run (struct ecce_session *s, char *commands) {
+   struct ecce_session *was = ses;
+   int outcome;
+
+   ses = s;
+   if (ses->finished == 0) {
+      ses->failures = 0L;
+      outcome = setjmp (ses->bail);
+      if (outcome == 0) {
+         obey_commands (commands);
+         outcome = (ses->failures != 0L) ? ECCE_FAILED : ECCE_OK;
+      } else {
+         ses->commandp = NULL;
+         ses->finished = outcome;
+      }
+   } else {
+      outcome = ses->finished;
+   }
+   print_flush ();
+   (void)fflush (ses->tty_out);
+   ses = was;
+   return outcome;
+}
+
+void ecce_text (struct ecce_session *s, char **first, size_t *first_len,
+                char **second, size_t *second_len) {
+   struct ecce_session *was = ses;
+
+   ses = s;
+   *first = ses->fbeg;
+   *first_len = ses->pp - ses->fbeg;
+   *second = ses->fp;
+   *second_len = ses->fend - ses->fp;
+   ses = was;
+}
+
+void ecce_close (struct ecce_session *s) {
+   struct ecce_session *was = ses;
+
+   ses = s;
+   if (ses->quiet) fclose (ses->tty_out);
+   free_buffers ();
+   free (s);
+   ses = (was == s) ? NULL : was;
+}
+#endif
+
+/* All of the following could be static inlines under GCC, or
+   I might recode some of them as #define'd macros */
+
+/* Case.  Every comparison used to work out the case mode afresh from
+   a pair of masks, twice a character.  Now select_case() settles it
+   once, when percent() changes the mode, into
+
+      fold[]      what a byte compares as: ASCII letters as lower case
+                  in %L, %U and %E, which ignore case, itself in %N
+      convert[]   what C makes of a byte: lower case in %L, upper in
+                  %U, the other case in %N and %E
+      match_at, match_back_at    the matchers for the mode
+
+   In the UTF-8 build the modes that ignore case fold the rest of
+   Unicode as well.  Two characters are the same if one is the
+   towlower() of the other and towupper() takes it back again, which
+   keeps out one-way mappings such as the Kelvin sign to 'k'.  So an
+   ASCII character only ever matches ASCII, and a text that is all
+   ASCII can still be matched, and skipped over, a byte at a time. */
+
+#ifdef WANT_UTF8
+#define NOT_A_CHAR 0x110000   /* plus the byte, for one that isn't part of a valid sequence */
+
+/* The character starting at p, and its length */
+static ecce_int utf8_get (const unsigned char *p, int *len) {
+   ecce_int c = *p;
+   int need, i;
+
+   *len = 1;
+   if (c < 0x80) return c;
+   if ((0xC2 <= c) && (c <= 0xDF)) {
+      need = 1; c &= 0x1F;
+   } else if ((0xE0 <= c) && (c <= 0xEF)) {
+      need = 2; c &= 0x0F;
+   } else if ((0xF0 <= c) && (c <= 0xF4)) {
+      need = 3; c &= 0x07;
+   } else {
+      return NOT_A_CHAR + *p;
+   }
+   for (i = 1; i <= need; i++) {
+      if (!is_cont (p[i])) return NOT_A_CHAR + *p;
+      c = (c << 6) | (p[i] & 0x3F);
+   }
+   if (((need == 2) && ((c < 0x800) || ((0xD800 <= c) && (c <= 0xDFFF))))
+    || ((need == 3) && ((c < 0x10000) || (c > 0x10FFFF)))) return NOT_A_CHAR + *p;
+   *len = need + 1;
+   return c;
+}
+
+/* The character whose last byte is at p.  The bytes before that one
+   are at p + step, p + 2*step...: step is -1 in the buffer and +1 in
+   the reversed text of a minus command. */
+static ecce_int utf8_get_back (const unsigned char *p, int step, int *len) {
+   unsigned char seq[5] = {0, 0, 0, 0, 0};
+   ecce_int c;
+   int n = 0, i;
+
+   *len = 1;
+   if (*p < 0x80) return *p;
+   while ((n < 3) && is_cont (p[n * step])) n++;
+   for (i = 0; i <= n; i++) seq[n - i] = p[i * step];
+   c = utf8_get (seq, &i);
+   if (i != n + 1) return NOT_A_CHAR + *p;
+   *len = i;
+   return c;
+}
+
+static int utf8_put (unsigned char *p, ecce_int c) {
+   if (c < 0x80) {
+      p[0] = c;
+      return 1;
+   } else if (c < 0x800) {
+      p[0] = 0xC0 | (c >> 6);
+      p[1] = 0x80 | (c & 0x3F);
+      return 2;
+   } else if (c < 0x10000) {
+      p[0] = 0xE0 | (c >> 12);
+      p[1] = 0x80 | ((c >> 6) & 0x3F);
+      p[2] = 0x80 | (c & 0x3F);
+      return 3;
+   }
+   p[0] = 0xF0 | (c >> 18);
+   p[1] = 0x80 | ((c >> 12) & 0x3F);
+   p[2] = 0x80 | ((c >> 6) & 0x3F);
+   p[3] = 0x80 | (c & 0x3F);
+   return 4;
+}
+
+static ecce_int unicode_lower (ecce_int c) {
+   ecce_int l;
+   if (c >= NOT_A_CHAR) return c;
+   l = towlower (c);
+   return ((l != c) && ((ecce_int)towupper (l) == c)) ? l : c;
+}
+
+static ecce_int unicode_upper (ecce_int c) {
+   ecce_int u;
+   if (c >= NOT_A_CHAR) return c;
+   u = towupper (c);
+   return ((u != c) && ((ecce_int)towlower (u) == c)) ? u : c;
+}
+
+static ecce_int fold_char (ecce_int c) {
+   return (c < 0x800) ? ses->fold_low[c] : unicode_lower (c);
+}
+
+/* What C makes of a character */
+static ecce_int convert_char (ecce_int c) {
+   ecce_int l;
+   if (c < 0x80) return ses->convert[c];
+   if (ses->case_mode == 'L') return unicode_lower (c);
+   if (ses->case_mode == 'U') return unicode_upper (c);
+   l = unicode_lower (c);
+   return (l != c) ? l : unicode_upper (c);
+}
+#endif
+
+/* The matchers.  The forward ones are given where the text would
+   start, above the gap, and return where the match ends; the backward
+   ones are given where it would end, below the gap, and return where
+   it starts.  Both give NULL for no match.  A text never holds '\n',
+   so the '\n's at either end of the buffer stop any comparison. */
+
+static cindex match_exact (cindex q) {
+   unsigned long m = text_length (ses->pointer);
+   if ((unsigned long)(ses->a + ses->buffer_size - q) < m) return NULL;
+   return (memcmp (ses->text + ses->pointer, q, m * sizeof(ecce_char)) == 0) ? q + m : NULL;
+}
+
+static cindex match_exact_back (cindex q) {
+   const ecce_char *t = ses->text + ses->pointer;
+   while (*t != 0) if (*t++ != *q--) return NULL;
+   return q + 1;
+}
+
+#ifndef WANT_UTF8
+static cindex match_folded (cindex q) {
+   const unsigned char *t = (const unsigned char *)ses->text + ses->pointer;
+   while (*t != 0) if (ses->fold[*t++] != ses->fold[(unsigned char)*q++]) return NULL;
+   return q;
+}
+
+static cindex match_folded_back (cindex q) {
+   const unsigned char *t = (const unsigned char *)ses->text + ses->pointer;
+   while (*t != 0) if (ses->fold[*t++] != ses->fold[(unsigned char)*q--]) return NULL;
+   return q + 1;
+}
+#else
+static cindex match_unicode (cindex q) {
+   const unsigned char *t = (const unsigned char *)ses->text + ses->pointer;
+   int tl, ql;
+
+   while (*t != 0) {
+      if (*t < 0x80) {
+         if (ses->fold[*t++] != ses->fold[(unsigned char)*q++]) return NULL;
+      } else {
+         if (fold_char (utf8_get (t, &tl)) != fold_char (utf8_get ((unsigned char *)q, &ql))) return NULL;
+         t += tl;
+         q += ql;
+      }
+   }
+   return q;
+}
+
+static cindex match_unicode_back (cindex q) {
+   const unsigned char *t = (const unsigned char *)ses->text + ses->pointer;
+   int tl, ql;
+
+   while (*t != 0) {
+      if (*t < 0x80) {
+         if (ses->fold[*t++] != ses->fold[(unsigned char)*q--]) return NULL;
+      } else {
+         if (fold_char (utf8_get_back (t, 1, &tl)) != fold_char (utf8_get_back ((unsigned char *)q, -1, &ql))) return NULL;
+         t += tl;
+         q -= ql;
+      }
+   }
+   return q + 1;
+}
+#endif
+
+static void select_case (int mode) {
+   int c;
+
+   ses->case_mode = mode;
+   ses->case_blind = (mode != 'N');
+   for (c = 0; c < 256; c++) {
+      ses->fold[c] = c;
+      ses->convert[c] = c;
+      if (('a' <= (c | casebit)) && ((c | casebit) <= 'z')) {
+         if (ses->case_blind) ses->fold[c] = c | casebit;
+         if (mode == 'L') ses->convert[c] = c | casebit;
+         else if (mode == 'U') ses->convert[c] = c & ~casebit;
+         else ses->convert[c] = c ^ casebit;
+      }
+   }
+#ifdef WANT_UTF8
+   if (ses->case_blind) {
+      for (c = 0; c < 0x800; c++) ses->fold_low[c] = (c < 0x80) ? ses->fold[c] : unicode_lower (c);
+   }
+   ses->match_at = ses->case_blind ? match_unicode : match_exact;
+   ses->match_back_at = ses->case_blind ? match_unicode_back : match_exact_back;
+#else
+   ses->match_at = ses->case_blind ? match_folded : match_exact;
+   ses->match_back_at = ses->case_blind ? match_folded_back : match_exact_back;
+#endif
+}
+
+/* Can this_unit's text be compared a byte at a time?  Not in the UTF-8
+   build if it has a non-ASCII character and the mode ignores case,
+   since that might match a character of a different length. */
+static bool bytewise (void) {
+#ifdef WANT_UTF8
+   const unsigned char *t = (const unsigned char *)ses->text + ses->pointer;
+   if (ses->case_blind) while (*t != 0) if (*t++ >= 0x80) return FALSE;
+#endif
+   return TRUE;
+}
+
+/* The kernel behind C with a repeat count: convert n bytes at 'from'
+   into 'to', which is lower down, so an overlap does no harm.  In the
+   UTF-8 build it stops at the first non-ASCII byte.  Returns how many
+   it did. */
+static size_t convert_bytes (cindex to, cindex from, size_t n) {
+   size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+   /* a letter's case bit is flipped, set or cleared by the mode */
+   char x = ((ses->case_mode == 'L') || (ses->case_mode == 'U')) ? 0 : casebit;
+   char o = (ses->case_mode == 'L') ? casebit : 0;
+   char z = (ses->case_mode == 'U') ? casebit : 0;
+#endif
+#if defined(__AVX2__)
+   __m256i lo = _mm256_set1_epi8 ('a' - 1), hi = _mm256_set1_epi8 ('z' + 1);
+   __m256i bit = _mm256_set1_epi8 (casebit), vx = _mm256_set1_epi8 (x);
+   __m256i vo = _mm256_set1_epi8 (o), vz = _mm256_set1_epi8 (z);
+
+   for (; n - i >= 32; i += 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)(from + i));
+      __m256i l = _mm256_or_si256 (v, bit);   /* bytes >= 0x80 are negative, so never letters */
+      __m256i m = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpgt_epi8 (l, lo),
+                                                      _mm256_cmpgt_epi8 (hi, l)), bit);
+#ifdef WANT_UTF8
+      if (_mm256_movemask_epi8 (v) != 0) break;
+#endif
+      v = _mm256_xor_si256 (v, _mm256_and_si256 (m, vx));
+      v = _mm256_or_si256 (v, _mm256_and_si256 (m, vo));
+      v = _mm256_andnot_si256 (_mm256_and_si256 (m, vz), v);
+      _mm256_storeu_si256 ((__m256i *)(to + i), v);
+   }
+#elif defined(__SSE2__)
+   __m128i lo = _mm_set1_epi8 ('a' - 1), hi = _mm_set1_epi8 ('z' + 1);
+   __m128i bit = _mm_set1_epi8 (casebit), vx = _mm_set1_epi8 (x);
+   __m128i vo = _mm_set1_epi8 (o), vz = _mm_set1_epi8 (z);
+
+   for (; n - i >= 16; i += 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)(from + i));
+      __m128i l = _mm_or_si128 (v, bit);
+      __m128i m = _mm_and_si128 (_mm_and_si128 (_mm_cmpgt_epi8 (l, lo),
+                                                _mm_cmpgt_epi8 (hi, l)), bit);
+#ifdef WANT_UTF8
+      if (_mm_movemask_epi8 (v) != 0) break;
+#endif
+      v = _mm_xor_si128 (v, _mm_and_si128 (m, vx));
+      v = _mm_or_si128 (v, _mm_and_si128 (m, vo));
+      v = _mm_andnot_si128 (_mm_and_si128 (m, vz), v);
+      _mm_storeu_si128 ((__m128i *)(to + i), v);
+   }
+#endif
+   for (; i < n; i++) {
+#ifdef WANT_UTF8
+      if (((unsigned char)from[i] & 0x80) != 0) break;
+#endif
+      to[i] = ses->convert[(unsigned char)from[i]];
+   }
+   return i;
+}
+
+/* C: the character at fp, which isn't at lend */
+static bool convert_right (void) {
+#ifdef WANT_UTF8
+   unsigned char seq[4];
+   int old, new;
+   ecce_int c = utf8_get ((unsigned char *)ses->fp, &old);
+
+   if (c >= NOT_A_CHAR) {   /* leave a stray byte as it was */
+      *ses->pp++ = *ses->fp++;
+      while ((ses->fp != ses->lend) && is_cont(*ses->fp)) *ses->pp++ = *ses->fp++;
+      return TRUE;
+   }
+   if (c >= 0x80) {
+      new = utf8_put (seq, convert_char (c));
+      if ((new > old) && !make_room (new - old)) return (ses->ok = FALSE);
+      ses->fp += old;
+      (void)memcpy (ses->pp, seq, new);
+      ses->pp += new;
+      return TRUE;
+   }
+#endif
+   *ses->pp++ = ses->convert[(unsigned char)*ses->fp++];
+   while ((ses->fp != ses->lend) && is_cont(*ses->fp)) *ses->pp++ = *ses->fp++;
+   return TRUE;
+}
+
+/* c: the character before pp, which isn't at lbeg */
+static bool convert_left (void) {
+#ifdef WANT_UTF8
+   unsigned char seq[4];
+   int old, new;
+   ecce_int c = utf8_get_back ((unsigned char *)ses->pp - 1, -1, &old);
+
+   if (c >= NOT_A_CHAR) {
+      ecce_int b = *--ses->pp;
+      *--ses->fp = b;
+      while ((ses->pp != ses->lbeg) && is_cont(b)) *--ses->fp = b = *--ses->pp;
+      return TRUE;
+   }
+   if (c >= 0x80) {
+      new = utf8_put (seq, convert_char (c));
+      if ((new > old) && !make_room (new - old)) return (ses->ok = FALSE);
+      ses->pp -= old;
+      ses->fp -= new;
+      (void)memcpy (ses->fp, seq, new);
+      return TRUE;
+   }
+#endif
+   *--ses->fp = ses->convert[(unsigned char)*--ses->pp];
+   return TRUE;
+}
+
+/* C with a repeat count: convert up to repeat_count characters, or to
+   the end of the line if it's indefinite, in one go.  repeat_count is
+   left as though C had been obeyed once for each, so that
+   execute_unit() finishes off as it always did. */
+static void convert_run (void) {
+   long n = 0L;
+
+   while ((ses->fp != ses->lend) && ((ses->repeat_count <= 0L) || (n < ses->repeat_count))) {
+      size_t want = ses->lend - ses->fp, done;
+      if ((ses->repeat_count > 0L) && ((unsigned long)(ses->repeat_count - n) < want)) want = ses->repeat_count - n;
+      done = convert_bytes (ses->pp, ses->fp, want);
+      ses->pp += done;
+      ses->fp += done;
+      n += done;
+      if (done == want) continue;
+      if (!convert_right ()) {   /* a character outside ASCII */
+         ses->repeat_count -= n;
+         return;
+      }
+      n++;
+   }
+   ses->repeat_count -= n - 1L;
+}
+
+bool right (void) {
+   if (ses->fp == ses->lend) {
+      return (ses->ok = FALSE);
+   }
+   do { *ses->pp++ = *ses->fp++; } while ((ses->fp != ses->lend) && is_cont(*ses->fp));
+   return (ses->ok = TRUE);
+}
+
+bool left (void) {
+   if (ses->pp == ses->lbeg) {
+      return (ses->ok = FALSE);
+   }
+   do { *--ses->fp = *--ses->pp; } while ((ses->pp != ses->lbeg) && is_cont(*ses->fp));
+   return (ses->ok = TRUE);
+}
+
+/* The rest of the line goes across the gap in one block, rather than
+   a character at a time */
+void right_star(void) {                      /* Another macro */
+   size_t n = ses->lend - ses->fp;
+
+   (void)memmove (ses->pp, ses->fp, n * sizeof(ecce_char));
+   ses->pp += n;
+   ses->fp = ses->lend;
+}
+
+void left_star(void) {                       /* Likewise... */
+   size_t n = ses->pp - ses->lbeg;
+
+   ses->fp -= n;
+   (void)memmove (ses->fp, ses->lbeg, n * sizeof(ecce_char));
+   ses->pp = ses->lbeg;
+}
+
+void move (void) {
+   ses->ok = TRUE;
+   right_star ();
+   if (ses->fp == ses->fend) {
+      ses->ok = FALSE;
+      return;
+   }
+   *ses->pp++ = *ses->fp++;
+   ses->line_no++;
+   ses->lbeg = ses->pp;
+   ses->lend = line_end (ses->fp);
+   ses->ms_back = NULL;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) page_out ();
+#endif
+}
+
+void move_back(void) {
+   ses->ok = TRUE;
+   left_star ();
+   if (ses->pp == ses->fbeg) {
+      ses->ok = FALSE;
+      return;
+   }
+   *--ses->fp = *--ses->pp;
+   ses->line_no--;
+   ses->lend = ses->fp;
+   ses->lbeg = line_start (ses->pp);
+   ses->ms = NULL;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) page_out ();
+#endif
+}
+
+void move_star (void) {
+   size_t n;
+
+#ifdef HAVE_MMAP
+   while ((ses->window_size != 0UL) && ((unsigned long)(ses->fend - ses->fp) > ses->window_size)) {
+      n = ses->window_size;   /* a window at a time when paging */
+      (void)memmove (ses->pp, ses->fp, n * sizeof(ecce_char));
+      ses->pp += n;
+      ses->fp += n;
+      page_out ();
+   }
+#endif
+   n = ses->fend - ses->fp;
+   (void)memmove (ses->pp, ses->fp, n * sizeof(ecce_char));
+   ses->pp += n;
+   ses->fp = ses->fend;
+   ses->line_no = ses->line_count;
+   ses->lend = ses->fend;
+   ses->lbeg = line_start (ses->pp);
+   ses->ms_back = NULL;
+}
+
+void move_back_star (void) {
+   size_t n;
+
+#ifdef HAVE_MMAP
+   while ((ses->window_size != 0UL) && ((unsigned long)(ses->pp - ses->fbeg) > ses->window_size)) {
+      n = ses->window_size;
+      ses->pp -= n;
+      ses->fp -= n;
+      (void)memmove (ses->fp, ses->pp, n * sizeof(ecce_char));
+      page_out ();
+   }
+#endif
+   n = ses->pp - ses->fbeg;
+   ses->fp -= n;
+   (void)memmove (ses->fp, ses->fbeg, n * sizeof(ecce_char));
+   ses->pp = ses->fbeg;
+   ses->line_no = 0L;
+   ses->lbeg = ses->fbeg;
+   ses->lend = line_end (ses->fp);
+   ses->ms = NULL;
+}
+
+static unsigned long text_length (int p) {
+   int e = p;
+   while (ses->text[e] != 0) e++;
+   return e - p;
+}
+
+void insert (void) {
+   int p = ses->pointer;
+   (void)make_room (text_length (ses->pointer));
+   ses->ml_back = ses->pp;
+   while (ses->text[p] != 0) {
+     if (ses->pp == ses->fp) /* FULL! */ { ses->ok = FALSE; break; }
+     *ses->pp++ = ses->text[p++];
+   }
+   ses->ms_back = ses->pp;
+   ses->ms = NULL;
+}
+
+void insert_back (void) {
+   int p = ses->pointer;
+   (void)make_room (text_length (ses->pointer));
+   ses->ml = ses->fp;
+   while (ses->text[p] != 0) {
+     if (ses->pp == ses->fp) /* FULL! */ { ses->ok = FALSE; break; }
+     *--ses->fp = ses->text[p++];
+   }
+   ses->ms = ses->fp;
+   ses->ms_back = NULL;
+}
+
+/* I and i with a repeat count: all the copies at once, if there's
+   room for them all, filled by doubling what is already there.  If
+   there isn't, one at a time as before, so that it fails at the same
+   place. */
+static void insert_run (void) {
+   size_t m = text_length (ses->pointer), total, done;
+
+   if ((m == 0) || ((unsigned long)ses->repeat_count > ses->buffer_limit / m)
+    || !make_room (total = m * ses->repeat_count)) {
+      insert ();
+      return;
+   }
+   (void)memcpy (ses->pp, ses->text + ses->pointer, m * sizeof(ecce_char));
+   for (done = m; done < total; done += done) {
+      (void)memcpy (ses->pp + done, ses->pp, ((total - done < done) ? total - done : done) * sizeof(ecce_char));
+   }
+   ses->pp += total;
+   ses->ml_back = ses->pp - m;
+   ses->ms_back = ses->pp;
+   ses->ms = NULL;
+   ses->repeat_count = 1L;
+}
+
+static void insert_back_run (void) {
+   size_t m = text_length (ses->pointer), total, done;
+   int p = ses->pointer;
+
+   if ((m == 0) || ((unsigned long)ses->repeat_count > ses->buffer_limit / m)
+    || !make_room (total = m * ses->repeat_count)) {
+      insert_back ();
+      return;
+   }
+   ses->ml = ses->fp - (total - m);
+   while (ses->text[p] != 0) *--ses->fp = ses->text[p++];   /* the text is stored reversed */
+   for (done = m; done < total; done += done) {
+      size_t c = (total - done < done) ? total - done : done;
+      (void)memcpy (ses->fp - c, ses->fp, c * sizeof(ecce_char));
+      ses->fp -= c;
+   }
+   ses->ms = ses->fp;
+   ses->ms_back = NULL;
+   ses->repeat_count = 1L;
+}
+
+bool verify (void) {
+   cindex at = ahead ();
+   cindex y = ses->match_at (at);
+
+   if (y == NULL) return (ses->ok = FALSE);
+
+   ses->ms = at;
+   ses->ml = y;
+   ses->ms_back = NULL;
+
+   return (ses->ok = TRUE);
+}
+
+bool verify_back (void) {
+   cindex at = behind ();
+   cindex y = ses->match_back_at (at - 1);
+
+   if (y == NULL) return (ses->ok = FALSE);
+
+   ses->ms_back = at;
+   ses->ml_back = y;
+   ses->ms = NULL;
+
+   return (ses->ok = TRUE);
+}
+
+/* The searches used to walk the cursor along with right() and move(),
+   copying every character they passed across the gap.  Now they look
+   through the text on the far side of the gap where it lies, and only
+   move the gap once, to wherever they stop.  The result is the same,
+   cursor, lbeg/lend, ms_back and all. */
+
+/* The first q in [p, e) with (*q | fold_bit) == c, or e if there isn't
+   one; a vector at a time where we can. */
+static cindex scan_first (cindex p, cindex e, int c, int fold_bit) {
+#if defined(__AVX2__)
+   __m256i want = _mm256_set1_epi8 ((char)c), f = _mm256_set1_epi8 ((char)fold_bit);
+   while (e - p >= 32) {
+      __m256i v = _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *)p), f);
+      if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, want)) != 0) break;
+      p += 32;
+   }
+#elif defined(__SSE2__)
+   __m128i want = _mm_set1_epi8 ((char)c), f = _mm_set1_epi8 ((char)fold_bit);
+   while (e - p >= 16) {
+      __m128i v = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)p), f);
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, want)) != 0) break;
+      p += 16;
    }
-#else
-   if (('a' <= chr) && (chr <= 'z')) sym = (sym | to_lower_case)
-                                                & to_upper_case;
 #endif
-   return (sym);
+   while ((p != e) && ((*p | fold_bit) != c)) p++;
+   return p;
 }
 
-bool right (void) {
-   if (fp == lend) {
-      return (ok = FALSE);
+/* Likewise the last q in [lo, hi), or NULL */
+static cindex scan_last (cindex lo, cindex hi, int c, int fold_bit) {
+#if defined(__AVX2__)
+   __m256i want = _mm256_set1_epi8 ((char)c), f = _mm256_set1_epi8 ((char)fold_bit);
+   while (hi - lo >= 32) {
+      __m256i v = _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *)(hi - 32)), f);
+      if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, want)) != 0) break;
+      hi -= 32;
+   }
+#elif defined(__SSE2__)
+   __m128i want = _mm_set1_epi8 ((char)c), f = _mm_set1_epi8 ((char)fold_bit);
+   while (hi - lo >= 16) {
+      __m128i v = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(hi - 16)), f);
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, want)) != 0) break;
+      hi -= 16;
+   }
+#endif
+   while (hi != lo) {
+      if ((*--hi | fold_bit) == c) return hi;
    }
-   *pp++ = *fp++;
-   return (ok = TRUE);
+   return NULL;
 }
 
-bool left (void) {
-   if (pp == lbeg) {
-      return (ok = FALSE);
+/* The end of the line p is on, above the gap, and the start of one
+   below it */
+static cindex line_end (cindex p) {
+   return memchr (p, '\n', ses->fend + 1 - p);   /* there's always the '\n' at fend */
+}
+
+static cindex line_start (cindex p) {
+   cindex nl = scan_last (ses->fbeg, p, '\n', 0);
+   return (nl == NULL) ? ses->fbeg : nl + 1;
+}
+
+/* Where a forward search from p gives up: at the end of the lines'th
+   line, or at the end of the file if that comes first or lines is 0 */
+static cindex line_limit (cindex p, long lines) {
+   if (lines <= 0L) return ses->fend;
+   for (;;) {
+      p = memchr (p, '\n', ses->fend - p);
+      if (p == NULL) return ses->fend;
+      if (--lines == 0L) return p;
+      p++;
    }
-   *--fp = *--pp;
-   return (ok = TRUE);
 }
 
-void right_star(void) {                      /* Another macro */
-   while (fp != lend) *pp++ = *fp++;
+/* ... and a backward one: at the start of the lines'th line back */
+static cindex line_limit_back (cindex p, long lines) {
+   if (lines <= 0L) return ses->fbeg;
+   for (;;) {
+      p = scan_last (ses->fbeg, p, '\n', 0);
+      if (p == NULL) return ses->fbeg;
+      if (--lines == 0L) return p + 1;
+   }
 }
 
-void left_star(void) {                       /* Likewise... */
-   while (pp != lbeg) *--fp = *--pp;
+/* Lines.  line_no and line_count are kept up to date by everything
+   that carries a '\n' across the gap, or makes or deletes one, so
+   asking which line we are on, or how many there are, costs nothing
+   (%I).  count_lines() does the counting where a whole stretch goes
+   at once. */
+static long count_lines (cindex from, cindex to) {
+   long n = 0L;
+#if defined(__AVX2__)
+   __m256i nl = _mm256_set1_epi8 ('\n');
+   while (to - from >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)from);
+      n += __builtin_popcount ((unsigned)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, nl)));
+      from += 32;
+   }
+#elif defined(__SSE2__)
+   __m128i nl = _mm_set1_epi8 ('\n');
+   while (to - from >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)from);
+      n += __builtin_popcount ((unsigned)_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, nl)));
+      from += 16;
+   }
+#endif
+   while (from != to) if (*from++ == '\n') n++;
+   return n;
 }
 
-void move (void) {
-   ok = TRUE;
-   right_star ();
-   if (fp == fend) {
-      ok = FALSE;
+/* The start of the line k lines on from p's, or of the last line if
+   there aren't that many.  *found says how many there were. */
+static cindex lines_on (cindex p, long k, long *found) {
+   long n = 0L;
+   while (n < k) {
+      cindex nl = memchr (p, '\n', ses->fend - p);
+      if (nl == NULL) break;
+      p = nl + 1;
+      n++;
+   }
+   *found = n;
+   return p;
+}
+
+/* ... and k lines back, or of the first line */
+static cindex lines_back (cindex p, long k, long *found) {
+   long n = 0L;
+   for (;;) {
+      cindex nl = scan_last (ses->fbeg, p, '\n', 0);
+      if (nl == NULL) {
+         p = ses->fbeg;
+         break;
+      }
+      if (n == k) {
+         p = nl + 1;
+         break;
+      }
+      p = nl;
+      n++;
+   }
+   *found = n;
+   return p;
+}
+
+/* M with a repeat count: over as many lines as it asks for, or as
+   there are, with one move of the gap.  repeat_count is left as
+   though move() had been called for each line. */
+static void move_lines (void) {
+   long found;
+   cindex q = lines_on (ahead (), ses->repeat_count, &found);
+
+   if (found == 0L) {   /* on the last line: let move() fail */
+      step_move ();
       return;
    }
-   *pp++ = *fp++;
-   lbeg = pp;
-   lend = fp;
-   while (*lend != '\n') lend++;
-   ms_back = NULL;
+   cursor_to (q);
+   ses->repeat_count -= found - 1L;
 }
 
-void move_back(void) {
-   ok = TRUE;
-   left_star ();
-   if (pp == fbeg) {
-      ok = FALSE;
+/* ... and m */
+static void move_lines_back (void) {
+   long found;
+   cindex q = lines_back (behind (), ses->repeat_count, &found);
+
+   if (found == 0L) {
+      step_move_back (); cursor_back_to (ses->lbeg);
       return;
    }
-   *--fp = *--pp;
-   lend = fp;
-   lbeg = pp;
-   do { --lbeg; } while (*lbeg != '\n');
-   lbeg++;
-   ms = NULL;
+   cursor_back_to (q);
+   ses->repeat_count -= found - 1L;
 }
 
-void move_star (void) {
-   while (fp != fend) *pp++ = *fp++;
-   lend = fend;
-   lbeg = pp;
-   do { --lbeg; } while (*lbeg != '\n');
-   lbeg++;
-   ms_back = NULL;
+/* E and e with a repeat count: the characters go in one step.
+   repeat_count is left as though E had been obeyed for each. */
+static void erase_chars (void) {
+   long found;
+
+   ses->fp = chars_on (ses->fp, ses->lend, ses->repeat_count, &found);
+   ses->repeat_count -= found - 1L;
 }
 
-void move_back_star (void) {
-   while (pp != fbeg) *--fp = *--pp;
-   lbeg = fbeg;
-   lend = fp;
-   while (*lend != '\n')
-      lend++;
-   ms = NULL;
+static void erase_chars_back (void) {
+   long found;
+
+   ses->pp = chars_back (ses->pp, ses->lbeg, ses->repeat_count, &found);
+   ses->repeat_count -= found - 1L;
 }
 
-void insert (void) {
-   int p = pointer;
-   ml_back = pp;
-   while (text[p] != 0) {
-     if (pp == fp) /* FULL! */ { ok = FALSE; break; }
-     *pp++ = text[p++];
+/* K and k with a repeat count: as many whole lines as are wanted, or
+   as there are, cut out at once.  FALSE if there isn't a whole line to
+   cut, for a single K or k to fail on as it always did. */
+static bool kill_lines (bool back) {
+   long found;
+   cindex q;
+
+   if (back) {
+      left_star ();
+      q = lines_back (ses->pp, ses->repeat_count, &found);
+      if (found == 0L) return FALSE;
+      ses->pp = ses->lbeg = q;
+      ses->line_no -= found;
+      ses->ms = NULL;
+   } else {
+      q = lines_on (ses->fp, ses->repeat_count, &found);
+      if (found == 0L) return FALSE;
+      ses->pp = ses->lbeg;
+      ses->fp = q;
+      ses->lend = line_end (ses->fp);
    }
-   ms_back = pp;
-   ms = NULL;
+   ses->line_count -= found;
+   ses->repeat_count -= found - 1L;
+   return TRUE;
 }
 
-void insert_back (void) {
-   int p = pointer;
-   ml = fp;
-   while (text[p] != 0) {
-     if (pp == fp) /* FULL! */ { ok = FALSE; break; }
-     *--fp = text[p++];
+/* Going straight to a place: O<n> puts the cursor before the n'th
+   character of the file and Y<n> at the start of the n'th line, so
+   that something driving ecce (Emacs, say) can say where it is
+   without a search.  Characters are counted as Emacs counts them,
+   from 1, and in the UTF-8 build a character is a lead byte with its
+   continuation bytes. */
+static long count_chars (cindex from, cindex to) {
+#ifdef WANT_UTF8
+   long n = to - from;
+#if defined(__AVX2__)
+   __m256i c0 = _mm256_set1_epi8 (-64);
+   while (to - from >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)from);
+      n -= __builtin_popcount ((unsigned)_mm256_movemask_epi8 (_mm256_cmpgt_epi8 (c0, v)));
+      from += 32;
    }
-   ms = fp;
-   ms_back = NULL;
+#elif defined(__SSE2__)
+   __m128i c0 = _mm_set1_epi8 (-64);
+   while (to - from >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)from);
+      n -= __builtin_popcount ((unsigned)_mm_movemask_epi8 (_mm_cmpgt_epi8 (c0, v)));
+      from += 16;
+   }
+#endif
+   while (from != to) if (is_cont (*from++)) n--;
+   return n;
+#else
+   return to - from;
+#endif
 }
 
-bool verify (void) {
-   int x = pointer;
-   cindex y = fp-1;
-   ecce_int if_sym;
-   ecce_int sym ;
+/* The place k characters on from p, or e if there aren't that many
+   before it.  *found says how many there were. */
+static cindex chars_on (cindex p, cindex e, long k, long *found) {
+#ifdef WANT_UTF8
+   long n = 0L;
+#if defined(__AVX2__)
+   __m256i c0 = _mm256_set1_epi8 (-64);
+   while (e - p >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+      long lead = 32 - __builtin_popcount ((unsigned)_mm256_movemask_epi8 (_mm256_cmpgt_epi8 (c0, v)));
+      if (lead > k - n) break;
+      n += lead;
+      p += 32;
+   }
+#elif defined(__SSE2__)
+   __m128i c0 = _mm_set1_epi8 (-64);
+   while (e - p >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+      long lead = 16 - __builtin_popcount ((unsigned)_mm_movemask_epi8 (_mm_cmpgt_epi8 (c0, v)));
+      if (lead > k - n) break;
+      n += lead;
+      p += 16;
+   }
+#endif
+   for (; p != e; p++) {
+      if (!is_cont (*p)) {
+         if (n == k) break;
+         n++;
+      }
+   }
+   *found = n;
+   return p;
+#else
+   *found = ((e - p) < k) ? (e - p) : k;
+   return p + *found;
+#endif
+}
 
-   do {
-      sym = case_op (text[x++]);
-      if_sym = case_op (*++y);
-   } while (sym == if_sym);
+/* ... and k characters back from p, or to b */
+static cindex chars_back (cindex p, cindex b, long k, long *found) {
+#ifdef WANT_UTF8
+   long n = 0L;
+#if defined(__AVX2__)
+   __m256i c0 = _mm256_set1_epi8 (-64);
+   while (p - b >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)(p - 32));
+      long lead = 32 - __builtin_popcount ((unsigned)_mm256_movemask_epi8 (_mm256_cmpgt_epi8 (c0, v)));
+      if (lead >= k - n) break;
+      n += lead;
+      p -= 32;
+   }
+#elif defined(__SSE2__)
+   __m128i c0 = _mm_set1_epi8 (-64);
+   while (p - b >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)(p - 16));
+      long lead = 16 - __builtin_popcount ((unsigned)_mm_movemask_epi8 (_mm_cmpgt_epi8 (c0, v)));
+      if (lead >= k - n) break;
+      n += lead;
+      p -= 16;
+   }
+#endif
+   while ((p != b) && (n < k)) {
+      if (!is_cont (*--p)) n++;
+   }
+   *found = n;
+   return p;
+#else
+   *found = ((p - b) < k) ? (p - b) : k;
+   return p - *found;
+#endif
+}
+
+/* R and L with a repeat count: over as many characters as they ask
+   for, or as the line has, with one move of the cursor.  repeat_count
+   is left as though right() or left() had been called for each. */
+static void right_chars (void) {
+   cindex at = ahead ();
+   long found;
+   cindex q = chars_on (at, ses->lend, ses->repeat_count, &found);
+
+   if (found == 0L) {   /* at the end of the line: R fails */
+      ses->ok = FALSE;
+      return;
+   }
+   cursor_to (q);
+   ses->repeat_count -= found - 1L;
+}
 
-   if (sym != 0) return (ok = FALSE);
+static void left_chars (void) {
+   cindex at = behind ();
+   long found;
+   cindex q = chars_back (at, ses->lbeg, ses->repeat_count, &found);
+
+   if (found == 0L) {
+      ses->ok = FALSE;
+      return;
+   }
+   cursor_back_to (q);
+   ses->repeat_count -= found - 1L;
+}
 
-   ms = fp;
-   ml = y;
-   ms_back = NULL;
+/* O<n>: to just before character n, or the end of the file for O0
+   or if there are fewer than n */
+static bool goto_char (long n) {
+   long below = point (), found;
 
-   return (ok = TRUE);
+   ses->ms = ses->ms_back = NULL;
+   if (n <= 0L) {
+      cursor_to (ses->fend);
+      return TRUE;
+   }
+   n -= 1L;
+   if (n < below) {
+      cursor_back_to (chars_back (behind (), ses->fbeg, below - n, &found));
+      return TRUE;
+   }
+   cursor_to (chars_on (ahead (), ses->fend, n - below, &found));
+   return (found == n - below);
 }
 
-bool verify_back (void) {
-   int x = pointer - 1;
-   int y = 0;
-   ecce_int if_sym;
-   ecce_int sym;
+/* Y<n>: to the start of line n, or of the last line for Y0 or if
+   there are fewer than n */
+static bool goto_line (long n) {
+   long want, found;
 
-   do {
-      sym = case_op (text[++x]);
-      if_sym = case_op (*(pp - ++y));
-   } while (sym == if_sym);
+   ses->ms = ses->ms_back = NULL;
+   if ((n <= 0L) || (n - 1L > ses->line_count)) {
+      want = ses->line_count - ses->line_no;
+   } else {
+      want = n - 1L - ses->line_no;
+   }
+   if (want > 0L) {
+      cursor_to (lines_on (ahead (), want, &found));
+   } else {
+      cursor_back_to (lines_back (behind (), -want, &found));
+   }
+   return (n <= 0L) || (n - 1L <= ses->line_count);
+}
+
+/* Texts this long or longer are looked for with Horspool's algorithm
+   rather than by filtering on their first character */
+#ifndef HORSPOOL_MIN
+#define HORSPOOL_MIN 8
+#endif
+
+/* Horspool's skip table for this_unit's text, which is m long: how far
+   the window can move on when a given character is under its last
+   position.  It is built the first time the unit searches and kept
+   while the command line is obeyed, so (f/x/s/y/)0 builds it once.
+   The same table does for both directions, since the text of a minus
+   command is stored reversed. */
+static unsigned short *skip_table (int m) {
+   int blind = ses->case_blind;
+   unsigned short *t = ses->skip + ses->this_unit * 256;
+   int i;
+
+   if (ses->skip_for[ses->this_unit] == blind) return t;
+   for (i = 0; i < 256; i++) t[i] = m;
+   for (i = 0; i < m - 1; i++) {
+      int c = (unsigned char)ses->text[ses->pointer + i];
+      t[c] = m - 1 - i;
+      if (blind && ('a' <= (c | casebit)) && ((c | casebit) <= 'z')) t[c ^ casebit] = m - 1 - i;
+   }
+   ses->skip_for[ses->this_unit] = blind;
+   return t;
+}
+
+/* The gap stays where it is while the cursor only moves or looks:
+   motions and searches move 'cursor' instead, and the gap follows it
+   (settle()) when something is about to change the text, in one
+   memmove however far the cursor went.  While cursor is set it lies
+   on one side of the gap or the other, and lbeg, lend, line_no and
+   the match pointers are all kept for where it is.  That can leave
+   lbeg and pp_before, which belong below the gap, above it for now,
+   or lend and fp_before below it, and settle() puts them right.  No
+   others: a pointer left in the gap by an earlier move must stay as
+   it is, as it would have, to be good again when the gap comes back.
+   cursor is NULL when the gap is at the cursor.  Paging (-window) wants the
+   gap near the text in use, so there the gap always follows. */
+
+/* Move the gap one step towards the cursor: all the way, or a window
+   at a time when paging */
+static void shift_gap (void) {
+   cindex q = ses->cursor;
+   long d;
+   size_t n;
+
+   if (q >= ses->fp) {   /* [fp, q) goes down below the gap */
+#ifdef HAVE_MMAP
+      if ((ses->window_size != 0UL) && ((unsigned long)(q - ses->fp) > ses->window_size)) q = ses->fp + ses->window_size;
+#endif
+      n = q - ses->fp;
+      d = ses->pp - ses->fp;
+      if ((ses->lbeg >= ses->fp) && (ses->lbeg <= q)) ses->lbeg += d;
+      if ((ses->pp_before != NULL) && (ses->pp_before >= ses->fp) && (ses->pp_before <= q)) ses->pp_before += d;
+      (void)memmove (ses->pp, ses->fp, n * sizeof(ecce_char));
+      ses->pp += n;
+      ses->fp = q;
+   } else {         /* [q, pp) goes up above it */
+#ifdef HAVE_MMAP
+      if ((ses->window_size != 0UL) && ((unsigned long)(ses->pp - q) > ses->window_size)) q = ses->pp - ses->window_size;
+#endif
+      n = ses->pp - q;
+      d = ses->fp - ses->pp;
+      if ((ses->lend >= q) && (ses->lend < ses->pp)) ses->lend += d;
+      if ((ses->fp_before != NULL) && (ses->fp_before >= q) && (ses->fp_before < ses->pp)) ses->fp_before += d;
+      ses->fp -= n;
+      (void)memmove (ses->fp, q, n * sizeof(ecce_char));
+      ses->pp = q;
+   }
+   if ((ses->pp == ses->cursor) || (ses->fp == ses->cursor)) ses->cursor = NULL;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) page_out ();
+#endif
+}
+
+/* Bring the gap to the cursor */
+static void settle (void) {
+   while (ses->cursor != NULL) shift_gap ();
+}
 
-   if (sym != 0) return (ok = FALSE);
+/* The cursor as seen from above the gap, [fp, fend], for moving on */
+static cindex ahead (void) {
+   if ((ses->cursor != NULL) && (ses->cursor < ses->fp)) settle ();
+   return (ses->cursor != NULL) ? ses->cursor : ses->fp;
+}
 
-   ms_back = pp;
-   ml_back = pp - y + 1;
-   ms = NULL;
+/* ... and from below, [fbeg, pp], for moving back */
+static cindex behind (void) {
+   if ((ses->cursor != NULL) && (ses->cursor > ses->pp)) settle ();
+   return (ses->cursor != NULL) ? ses->cursor : ses->pp;
+}
 
-   return (ok = TRUE);
+/* How many characters there are before the cursor */
+static long point (void) {
+   if (ses->cursor == NULL) return count_chars (ses->fbeg, ses->pp);
+   if (ses->cursor < ses->pp) return count_chars (ses->fbeg, ses->cursor);
+   return count_chars (ses->fbeg, ses->pp) + count_chars (ses->fp, ses->cursor);
 }
 
-bool find (void) {
-   ecce_int sym = text[pointer] | casebit;
+/* Move the cursor forward to q, which is at or after ahead(): what
+   right() and move() would have done to get there, without going a
+   character at a time and without moving the gap */
+static void cursor_to (cindex q) {
+   cindex at = ahead (), nl;
+
+   if (q == at) return;
+   ses->line_no += count_lines (at, q);
+   nl = scan_last (at, q, '\n', 0);
+   if (nl != NULL) {
+      ses->lbeg = nl + 1;
+      ses->lend = line_end (q);
+      ses->ms_back = NULL;
+   }
+   ses->cursor = q;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) settle ();
+#endif
+}
+
+/* ... and back to q, at or before behind(), as left() and move_back()
+   would have */
+static void cursor_back_to (cindex q) {
+   cindex at = behind (), nl;
+
+   if (q == at) return;
+   ses->line_no -= count_lines (q, at);
+   nl = memchr (q, '\n', at - q);                 /* end of q's line */
+   if (nl != NULL) {
+      ses->lend = nl;
+      ses->lbeg = line_start (q);
+      ses->ms = NULL;
+   }
+   ses->cursor = q;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) settle ();
+#endif
+}
+
+/* right(), left(), move() and move_back() for the cursor */
+static bool step_right (void) {
+   cindex at = ahead ();
+
+   if (at == ses->lend) return (ses->ok = FALSE);
+   do at++; while ((at != ses->lend) && is_cont (*at));
+   cursor_to (at);
+   return (ses->ok = TRUE);
+}
+
+static bool step_left (void) {
+   cindex at = behind ();
+
+   if (at == ses->lbeg) return (ses->ok = FALSE);
+   do --at; while ((at != ses->lbeg) && is_cont (*at));
+   cursor_back_to (at);
+   return (ses->ok = TRUE);
+}
+
+static void step_move (void) {
+   (void) ahead ();
+   ses->ok = (ses->lend != ses->fend);
+   cursor_to (ses->ok ? ses->lend + 1 : ses->lend);
+}
+
+static void step_move_back (void) {
+   (void) behind ();
+   ses->ok = (ses->lbeg != ses->fbeg);
+   cursor_back_to (ses->ok ? ses->lbeg - 1 : ses->lbeg);
+}
+
+/* M0 and m0, from either side of the gap: the line at the far end is
+   found without going over what lies between */
+static void cursor_to_end (void) {
+   cindex nl;
+
+   if ((ses->cursor == NULL) || (ses->cursor > ses->pp)) {
+      cursor_to (ses->fend);
+   } else {
+      ses->line_no = ses->line_count;
+      nl = scan_last (ses->fp, ses->fend, '\n', 0);
+      ses->lbeg = (nl == NULL) ? line_start (ses->pp) : nl + 1;
+      ses->lend = ses->fend;
+      ses->cursor = (ses->fp == ses->fend) ? NULL : ses->fend;
+#ifdef HAVE_MMAP
+      if (ses->window_size != 0UL) settle ();
+#endif
+   }
+   ses->ms_back = NULL;
+}
+
+static void cursor_to_start (void) {
+   if ((ses->cursor == NULL) || (ses->cursor < ses->pp)) {
+      cursor_back_to (ses->fbeg);
+   } else {
+      ses->line_no = 0L;
+      ses->lbeg = ses->fbeg;
+      ses->lend = memchr (ses->fbeg, '\n', ses->pp - ses->fbeg);
+      if (ses->lend == NULL) ses->lend = line_end (ses->fp);
+      ses->cursor = (ses->pp == ses->fbeg) ? NULL : ses->fbeg;
+#ifdef HAVE_MMAP
+      if (ses->window_size != 0UL) settle ();
+#endif
+   }
+   ses->ms = NULL;
+}
+
+/* Where the text of the unit at 'pointer' is next found at or after
+   'at', starting before 'stop'; NULL if it isn't */
+static cindex search (cindex at, cindex stop) {
+   int fold_bit = ses->case_blind ? casebit : 0;
+   ecce_int first = ses->text[ses->pointer] | fold_bit;
+   int m = text_length (ses->pointer);
+   cindex q;
+
+   if (!bytewise ()) {   /* try every character */
+      for (q = at; q != stop; q++) {
+         if (!is_cont (*q) && (ses->match_at (q) != NULL)) return q;
+      }
+      return NULL;
+   }
+   if (m >= HORSPOOL_MIN) {
+      unsigned short *t = skip_table (m);
+      int last = ses->fold[(unsigned char)ses->text[ses->pointer + m - 1]];
+
+      for (q = at; stop - q >= m; q += t[(unsigned char)q[m - 1]]) {
+         if ((ses->fold[(unsigned char)q[m - 1]] == last) && !is_cont (*q) && (ses->match_at (q) != NULL)) return q;
+      }
+      return NULL;
+   }
+   for (q = at; (q = scan_first (q, stop, first, fold_bit)) != stop; q++) {
+      if (!is_cont (*q) && (ses->match_at (q) != NULL)) return q;   /* only at the start of a character */
+   }
+   return NULL;
+}
+
+/* ... and going back from 'from', for a match that ends after 'start':
+   where the cursor would go, or NULL.  'at' is where it is now. */
+static cindex search_back (cindex at, cindex from, cindex start) {
+   int fold_bit = ses->case_blind ? casebit : 0;
+   ecce_int last = ses->text[ses->pointer] | fold_bit;   /* the last character: it's stored reversed */
+   int m = text_length (ses->pointer);
+   cindex q;
+
+   if (!bytewise ()) {
+      for (q = from; q != start; q--) {
+         if (((q == at) || !is_cont (*q)) && (ses->match_back_at (q - 1) != NULL)) return q;
+      }
+      return NULL;
+   }
+   if (m >= HORSPOOL_MIN) {
+      unsigned short *t = skip_table (m);
+      int first = ses->fold[(unsigned char)ses->text[ses->pointer + m - 1]];
 
-   pp_before = pp;
-   limit = lim[this_unit];
-   if (fp == ms) {
-      if (!(right ())) move ();
+      for (q = from; q - start >= m; q -= t[(unsigned char)q[-m]]) {
+         if ((ses->fold[(unsigned char)q[-m]] == first) && ((q == at) || !is_cont (*q))
+          && (ses->match_back_at (q - 1) != NULL)) return q;
+      }
+      return NULL;
+   }
+   for (q = from; (q = scan_last (start, q, last, fold_bit)) != NULL; ) {
+      if (((q + 1 == at) || !is_cont (q[1])) && (ses->match_back_at (q) != NULL)) return q + 1;
    }
+   return NULL;
+}
+
+/* A search that has a long way to go is cut into pieces of
+   SEARCH_PIECE characters, and -jobs threads take them in turn, nearest
+   the cursor first.  Each piece is searched as far as m - 1 characters
+   into the next, so that a match across the seam is found whole, and
+   the nearest piece with a match gives the answer: the match the
+   search would have come to first.  Once one is found no more pieces
+   are taken beyond it.  The threads only read the text and the
+   session, which is lent to them while its own thread waits, and the
+   skip table is made before they start.  The first piece is always
+   searched on its own, so that a match close by costs no threads,
+   and less than SEARCH_MIN to go isn't worth them. */
+#ifndef SEARCH_MIN
+#define SEARCH_MIN (8L*1024L*1024L)
+#define SEARCH_PIECE (1024L*1024L)
+#endif
+
+struct far_search {
+   struct ecce_session *s;
+   bool back;
+   cindex at, from, end;    /* the cursor, where the pieces start, and where they stop */
+   long pieces;
+   long next, found;        /* the next piece to take, and the nearest with a match: under search_lock */
+   cindex *hits;            /* what each piece found */
+};
+
+#ifdef HAVE_THREADS
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *search_worker (void *arg) {
+   struct far_search *fs = arg;
+   int m;
+   long k;
+   cindex lo, hi, q;
+
+#ifdef ECCE_LIBRARY
+   ses = fs->s;
+#else
+   if (fs->s != ses) *ses = *fs->s;   /* a copy will do: the search only reads it */
+#endif
+   m = text_length (ses->pointer);
    for (;;) {
-      if ((*fp | casebit) == sym) {
-         if (verify ()) return (ok);
+      (void)pthread_mutex_lock (&search_lock);
+      k = fs->next;
+      if ((k >= fs->pieces) || (k > fs->found)) k = -1L;
+      else fs->next++;
+      (void)pthread_mutex_unlock (&search_lock);
+      if (k < 0L) break;
+      if (!fs->back) {
+         lo = fs->from + k * SEARCH_PIECE;
+         hi = (fs->end - lo > SEARCH_PIECE + m - 1) ? lo + SEARCH_PIECE + m - 1 : fs->end;
+         q = search (lo, hi);
+      } else {
+         hi = fs->from - k * SEARCH_PIECE;
+         lo = (hi - fs->end > SEARCH_PIECE + m - 1) ? hi - SEARCH_PIECE - (m - 1) : fs->end;
+         q = search_back (fs->at, hi, lo);
+      }
+      fs->hits[k] = q;
+      if (q != NULL) {
+         (void)pthread_mutex_lock (&search_lock);
+         if (k < fs->found) fs->found = k;
+         (void)pthread_mutex_unlock (&search_lock);
       }
-      if (!right ()) {
-         --limit;
-         if (limit == 0L) break;
-         move ();
-         if (!ok) break;
+   }
+   return NULL;
+}
+#endif
+
+/* search() from 'at' to 'end', or search_back() from 'at' back to it,
+   on threads if it is far enough */
+static cindex search_far (cindex at, cindex end, bool back) {
+   long size = back ? at - end : end - at;
+   int m = text_length (ses->pointer);
+   cindex q, from;
+#ifdef HAVE_THREADS
+   struct far_search fs;
+   pthread_t *thread;
+   int n, i;
+#endif
+
+   if ((ses->jobs < 2) || (size < SEARCH_PIECE + SEARCH_MIN)
+#ifdef HAVE_MMAP
+    || (ses->window_size != 0UL)
+#endif
+    ) return back ? search_back (at, at, end) : search (at, end);
+   if (!back) {   /* the first piece */
+      from = at + SEARCH_PIECE;
+      q = search (at, from + m - 1);
+   } else {
+      from = at - SEARCH_PIECE;
+      q = search_back (at, at, from - (m - 1));
+   }
+   if (q != NULL) return q;
+#ifdef HAVE_THREADS
+   if (bytewise () && (m >= HORSPOOL_MIN)) (void) skip_table (m);   /* so that the threads need only read it */
+   fs.s = ses;
+   fs.back = back;
+   fs.at = at;
+   fs.from = from;
+   fs.end = end;
+   fs.pieces = (size - 1) / SEARCH_PIECE;   /* what's left after the first, rounded up */
+   fs.next = 0L;
+   fs.found = fs.pieces;
+   fs.hits = malloc (fs.pieces * sizeof(cindex));
+   n = (ses->jobs < fs.pieces) ? ses->jobs : (int)fs.pieces;
+   thread = malloc (n * sizeof(pthread_t));
+   if ((fs.hits != NULL) && (thread != NULL)) {
+      for (i = 0; i < n - 1; i++) {   /* and this thread is the last */
+         if (pthread_create (&thread[i], NULL, search_worker, &fs) != 0) break;
       }
+      (void) search_worker (&fs);
+      while (--i >= 0) (void)pthread_join (thread[i], NULL);
+      q = (fs.found < fs.pieces) ? fs.hits[fs.found] : NULL;
+      free (fs.hits);
+      free (thread);
+      return q;
    }
+   free (fs.hits);
+   free (thread);
+#endif
+   return back ? search_back (at, from, end) : search (from, end);
+}
+
+bool find (void) {
+   cindex at = ahead (), q, stop;
 
-   return (ok = FALSE);
+   ses->pp_before = (at == ses->fp) ? ses->pp : at;
+   ses->limit = ses->lim[ses->this_unit];
+   if (at == ses->ms) {
+      if (!(step_right ())) step_move ();
+      at = ahead ();
+   }
+   stop = line_limit (at, ses->limit);
+   q = search_far (at, stop, FALSE);
+   while (stream_short (q, stop)) {   /* U takes out what it passes: the cursor stays */
+      at = stream_past (at, q, &ses->limit, (ses->command & ~plusbit) != 'U');
+      stop = line_limit (at, ses->limit);
+      q = search_far (at, stop, FALSE);
+   }
+   if (q == NULL) {
+      cursor_to (stop);
+      return (ses->ok = FALSE);
+   }
+   cursor_to (q);
+   return verify ();
 }
 
 bool find_back (void) {
-   fp_before = fp;
-   limit = lim[this_unit];
-   if (pp == ms_back) {
-      if (!left ()) move_back ();
+   cindex at = behind (), q, start;
+
+   ses->fp_before = (at == ses->pp) ? ses->fp : at;
+   ses->limit = ses->lim[ses->this_unit];
+   if (at == ses->ms_back) {
+      if (!step_left ()) step_move_back ();
+      at = behind ();
+   }
+   start = line_limit_back (at, ses->limit);
+   q = search_far (at, start, TRUE);
+   if (q == NULL) {
+      cursor_back_to (start);
+      return (ses->ok = FALSE);
+   }
+   cursor_back_to (q);
+   return verify_back ();
+}
+
+/* (F/x/S/y/)0, (D/x/)0 and (T/x/I/y/)0 are what most scripts come
+   down to.  Obeyed a unit at a time each match costs a trip round the
+   interpreter, a search set up afresh and an insertion a character at
+   a time.  When the '(' of one of them is obeyed, global_edit() makes
+   the passes itself instead: it finds each match with the search F
+   uses, moves the text up to it below the gap in one memmove and
+   copies the new text in after it, leaving the cursor, the line
+   numbers and the match pointers as the units would have.  The pass
+   that finds nothing more, or that would run out of room, is left to
+   the units, so the loop ends, and fails or not, exactly as before.
+   Paging mode keeps to the units. */
+static void global_edit (void) {
+   int open = ses->this_unit, close = ses->pointer, look = open + 1;
+   int kind = ses->idiom[open], put = ses->link[open + 2];
+   long n = (kind == 'D') ? 0L : (long)text_length (put), more, qo, eo, lines;
+   cindex at, q, e, nl, stop;
+
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) return;
+#endif
+   settle ();
+   if (ses->tracking) note_gap ();
+   for (;;) {
+      if (IntSeen || (ses->num[close] - 1L == ses->stopper)) break;
+      ses->this_unit = look;
+      ses->pointer = ses->link[look];
+      at = ses->fp;
+      if (at == ses->ms) {   /* find() steps off the match it is on */
+         if (at != ses->lend) {
+            do at++; while ((at != ses->lend) && is_cont (*at));
+         } else if (ses->lend != ses->fend) {
+            at = ses->lend + 1;
+         }
+      }
+      lines = ses->lim[look];
+      stop = line_limit (at, lines);
+      q = search (at, stop);
+      if (stream_short (q, stop)) {   /* streaming: on into the next block */
+         if (lines != 0L) break;
+         (void) stream_past (at, q, &lines, TRUE);
+         continue;
+      }
+      if (q == NULL) break;
+      e = ses->match_at (q);
+      if (kind != 'D') {   /* the room that S or I will ask for, asked for now */
+         more = n - ((kind == 'S') ? (e - q) : 0L);
+         qo = q - ses->fp;
+         eo = e - ses->fp;
+         if (!make_room ((more < 0L) ? 0UL : (unsigned long)more)) break;
+         q = ses->fp + qo;
+         e = ses->fp + eo;
+      }
+      ses->pp_before = ses->pp;
+      nl = scan_last (ses->fp, q, '\n', 0);
+      if (nl != NULL) {
+         ses->line_no += count_lines (ses->fp, q);
+         ses->lbeg = nl + 1 + (ses->pp - ses->fp);
+         ses->lend = line_end (q);
+      }
+      (void)memmove (ses->pp, ses->fp, (q - ses->fp) * sizeof(ecce_char));
+      ses->pp += q - ses->fp;
+      if (kind == 'I') {   /* T goes past the match */
+         (void)memmove (ses->pp, q, (e - q) * sizeof(ecce_char));
+         ses->pp += e - q;
+      }
+      ses->fp = e;
+      ses->ml = e;
+      ses->ms_back = NULL;
+      if (kind == 'D') {
+         ses->ms = ses->fp;
+      } else {
+         ses->ml_back = ses->pp;
+         (void)memcpy (ses->pp, ses->text + put, n * sizeof(ecce_char));
+         ses->pp += n;
+         ses->ms_back = ses->pp;
+         ses->ms = NULL;
+      }
+      --ses->num[close];
+   }
+   if (ses->tracking) note_gap ();
+   ses->this_unit = open;
+   ses->pointer = close;
+}
+
+/* A loop such as (F1/x/S/y/,M)0 or (V/#/K,M)0 goes through the text a
+   line at a time, and what it makes of each line depends on that line
+   alone, so long as it looks no further than the line it is on and
+   leaves it only by an M or K that takes it straight round the loop
+   again.  lines_apart() is the test, made when the line is analysed;
+   the loops that pass it are marked 'M' in idiom[].  When the text
+   from the cursor on is big enough, run_lines() cuts it at line ends
+   into a piece for each of -jobs threads.  Each thread runs the loop
+   over its piece in a session of its own, from the start of the
+   piece's first line to where it comes round again at the end of the
+   piece.  The pieces up to the one in which the loop ended then take
+   the place of the old lines, and the rest are left as they were, so
+   that the text, the cursor and the line numbers are what the units
+   would have made of them.  The pieces after that one were wasted
+   work, and are stopped if they look like going on for ever.  Anything
+   run_lines() can't be sure of, it leaves to the units. */
+
+#ifndef LINES_MIN
+#define LINES_MIN (1024L*1024L)   /* less text than this isn't worth the threads */
+#define LINES_PIECE (256L*1024L)  /* ... nor is a piece smaller than this */
+#endif
+
+/* Whether the loop opened at unit 'open' keeps to a line at a time.
+   Finds must be F1, f1, U1, u1 or T1.  I- and S-, B-, D and T- are out,
+   because they leave ms, or put text after the cursor, where a later
+   find or S could be taken to the next line or the last.  So is an
+   empty V, or an empty I or S with a backward find about. */
+static bool lines_apart (int open) {
+   int close = ses->link[open], u, depth = 0;
+   bool moves = FALSE, back = FALSE, empty = FALSE;
+
+   for (u = open + 1; u < close; u++) {
+      switch (ses->com[u]) {
+         case '(':
+            depth++;
+            break;
+         case ')':
+            depth--;
+            break;
+         case ',': case '?':
+            break;
+         case '\\':   /* after an indefinite repetition it fails the whole line */
+            if (ses->num[u-1] <= 0L) return FALSE;
+            break;
+         case 'M': case 'K':
+            if ((depth != 0) || (ses->num[u] != 1L) || ((ses->com[u+1] != ',') && (u + 1 != close))) return FALSE;
+            moves = TRUE;
+            break;
+         case 'R': case 'r': case 'L': case 'l': case 'E': case 'e': case 'C': case 'c': case 'B':
+            break;
+         case 'f': case 'u':
+            back = TRUE;
+            /* fall through */
+         case 'F': case 'U': case 'T':
+            if (ses->lim[u] != 1L) return FALSE;
+            /* fall through */
+         case 'V': case 'v':
+            if (ses->text[ses->link[u]] == 0) return FALSE;
+            break;
+         case 'I': case 'S':
+            if (ses->text[ses->link[u]] == 0) empty = TRUE;
+            break;
+         default:
+            return FALSE;
+      }
+   }
+   return moves && !(back && empty);
+}
+
+#ifdef HAVE_THREADS
+#define PIECE_FAILED 0   /* couldn't start, ran out of room, or ^C */
+#define PIECE_SEAM   1   /* came round the loop at the end of the piece */
+#define PIECE_ENDED  2   /* the loop ended in it */
+
+static pthread_mutex_t lines_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct lines_piece {
+   struct program *prog;
+   int index;
+   int *ended;              /* the first piece the loop has ended in, so far: under lines_lock */
+   int open, close;         /* the loop's '(' and ')' */
+   int casing;              /* case_mode */
+   long count_limit;        /* stopper */
+   unsigned long room;      /* its share of buffer_limit */
+   cindex head, head_end;   /* the first piece's: its line up to the cursor */
+   cindex from, to;         /* its lines, in the main buffer */
+   long old_len;            /* how many there were of them, head and all */
+   long at[4];              /* the first piece's ms, ml, ms_back and ml_back, as offsets, or -1 */
+   bool last;
+   /* what became of it */
+   int outcome;
+   cindex buffer;                   /* its session's, kept for what follows */
+   cindex lo, lo_end, hi, hi_end;   /* its text, below and above the cursor */
+   long lines_before, lines_after, line_at;
+   long count;              /* num[] of the loop's ')' */
+   bool dirty;              /* came round with ms_back set: see run_lines() */
+};
+
+/* Tell the pieces after 'index' that they are working for nothing:
+   all of them, if index is -1 */
+static void piece_ended (struct lines_piece *pi, int index) {
+   (void)pthread_mutex_lock (&lines_lock);
+   if (*pi->ended > index) *pi->ended = index;
+   (void)pthread_mutex_unlock (&lines_lock);
+}
+
+static void *lines_worker (void *arg) {
+   struct lines_piece *pi = arg;
+   long head_len = pi->head_end - pi->head, len = pi->to - pi->from;
+   long rounds = -2L * (head_len + len) - 64L;   /* more than that, and it's going round in circles */
+   cindex ends[4];
+   int outcome = PIECE_FAILED, i, units = 0;
+   bool late;
+
+   if (!new_session ()) {
+      piece_ended (pi, -1);
+      return NULL;
+   }
+   ses->tty_out = stderr;
+   ses->buffer_limit = pi->room;
+   ses->buffer_size = (unsigned long)(head_len + len + len / 4L + 65536L);   /* room to grow, and more if need be */
+   if (ses->buffer_size > ses->buffer_limit) ses->buffer_size = ses->buffer_limit;
+   ses->min_buffer_size = ses->buffer_size;
+   if (!init_globals ()) {
+      end_session ();
+      piece_ended (pi, -1);
+      return NULL;
    }
+   ses->a[0]                = '\n';
+   ses->a[ses->buffer_size] = '\n';
+   ses->stopper = pi->count_limit;
+   select_case (pi->casing);
+   load_program (pi->prog);
+
+   (void)memcpy (ses->fbeg, pi->head, head_len * sizeof(ecce_char));
+   ses->pp = ses->fbeg + head_len;
+   ses->fp = ses->fend - len;
+   (void)memcpy (ses->fp, pi->from, len * sizeof(ecce_char));
+   ses->lbeg = ses->fbeg;
+   ses->lend = line_end (ses->fp);
+   ses->line_count = pi->lines_before = count_lines (ses->fp, ses->fend);
+   ses->ms = (pi->at[0] < 0L) ? NULL : ses->fp + pi->at[0];
+   ses->ml = (pi->at[1] < 0L) ? NULL : ses->fp + pi->at[1];
+   ses->ms_back = (pi->at[2] < 0L) ? NULL : ses->fbeg + pi->at[2];
+   ses->ml_back = (pi->at[3] < 0L) ? NULL : ses->fbeg + pi->at[3];
+
+   ses->ok = TRUE;
+   ses->this_unit = pi->open + 1;
    for (;;) {
-      if (verify_back ()) return(ok);
-      if (!left ()) {
-         --limit;
-         if (limit == 0L) break;
-         move_back ();
-         if (!ok) break;
+      if (ses->this_unit == pi->open + 1) {
+         if (!pi->last && (ahead () == ses->fend)) {
+            outcome = PIECE_SEAM;
+            break;
+         }
+         if (ses->num[pi->close] < rounds) break;   /* leave it to the units */
+      }
+      if ((++units & 255) == 0) {   /* the units would never get here: don't loop for ever */
+         (void)pthread_mutex_lock (&lines_lock);
+         late = (*pi->ended < pi->index);
+         (void)pthread_mutex_unlock (&lines_lock);
+         if (late) break;
+      }
+      if (!execute_unit () || IntSeen || ses->out_of_room) break;
+      if (++ses->this_unit > pi->close) {
+         outcome = PIECE_ENDED;
+         break;
+      }
+   }
+   if (outcome != PIECE_SEAM) piece_ended (pi, (outcome == PIECE_ENDED) ? pi->index : -1);
+
+   settle ();
+   pi->lo = ses->fbeg;
+   pi->lo_end = ses->pp;
+   pi->hi = ses->fp;
+   pi->hi_end = ses->fend;
+   pi->lines_after = ses->line_count;
+   pi->line_at = ses->line_no;
+   pi->count = ses->num[pi->close];
+   pi->dirty = (ses->ms_back != NULL);
+   ends[0] = ses->ms; ends[1] = ses->ml; ends[2] = ses->ms_back; ends[3] = ses->ml_back;
+   for (i = 0; i < 4; i++) {
+      if (ends[i] == NULL) pi->at[i] = -1L;
+      else if (i < 2) pi->at[i] = ((ends[i] >= ses->fp) && (ends[i] <= ses->fend)) ? ends[i] - ses->fp : -1L;
+      else pi->at[i] = ((ends[i] >= ses->fbeg) && (ends[i] <= ses->pp)) ? ends[i] - ses->fbeg : -1L;
+   }
+   pi->outcome = outcome;
+   pi->buffer = ses->a;   /* run_lines() frees it when it has the text */
+   ses->a = NULL;
+   end_session ();
+   return NULL;
+}
+#endif
+
+/* Obey the loop at this_unit in pieces, if it is worth it and safe; if
+   not, say so and leave everything as it was */
+static bool run_lines (void) {
+#ifdef HAVE_THREADS
+   struct lines_piece *pi;
+   struct program prog;
+   pthread_t *thread;
+   int open = ses->this_unit, close = ses->pointer, n, made, i, k, ended;
+   long size, spare, grow, need, count, line, n1, n2;
+   cindex start, e, q;
+   bool fine = TRUE;
+
+   if ((ses->jobs < 2) || ses->tracking || ses->in_second || (ses->stream_in != NULL) || ((ses->noted != NULL) && (ses->noted >= ses->lbeg))) return FALSE;
+#ifdef HAVE_MMAP
+   if (ses->window_size != 0UL) return FALSE;
+#endif
+   settle ();
+   size = ses->fend - ses->fp;
+   if (size < LINES_MIN) return FALSE;
+   if (((ses->ms != NULL) && ((ses->ms < ses->fp) || (ses->ms > ses->fend))) || ((ses->ml != NULL) && ((ses->ml < ses->fp) || (ses->ml > ses->fend)))
+    || ((ses->ms_back != NULL) && ((ses->ms_back < ses->lbeg) || (ses->ms_back > ses->pp)))
+    || ((ses->ml_back != NULL) && ((ses->ml_back < ses->lbeg) || (ses->ml_back > ses->pp)))) return FALSE;
+   n = ses->jobs;
+   if (n > size / LINES_PIECE) n = (int)(size / LINES_PIECE);
+   spare = (long)ses->buffer_limit - (long)((ses->pp - ses->fbeg) + (ses->fend - ses->fp)) - n;
+   if ((n < 2) || (spare < 0L)) return FALSE;
+   if (!save_program (&prog)) return FALSE;
+   pi = calloc (n, sizeof(struct lines_piece));
+   thread = malloc (n * sizeof(pthread_t));
+   if ((pi == NULL) || (thread == NULL)) {
+      free (pi); free (thread);
+      free_program (&prog);
+      return FALSE;
+   }
+
+   for (made = 0, start = ses->fp; start < ses->fend; made++) {
+      q = start + size / n;
+      e = ((made == n - 1) || (q >= ses->fend)) ? ses->fend : line_end (q) + 1;
+      if (e > ses->fend) e = ses->fend;
+      pi[made].prog = &prog;
+      pi[made].index = made;
+      pi[made].ended = &ended;
+      pi[made].open = open;
+      pi[made].close = close;
+      pi[made].casing = ses->case_mode;
+      pi[made].count_limit = ses->stopper;
+      pi[made].head = pi[made].head_end = start;
+      pi[made].from = start;
+      pi[made].to = e;
+      pi[made].old_len = e - start;
+      pi[made].at[0] = pi[made].at[1] = pi[made].at[2] = pi[made].at[3] = -1L;
+      start = e;
+   }
+   pi[made - 1].last = TRUE;
+   pi[0].head = ses->lbeg;
+   pi[0].head_end = ses->pp;
+   pi[0].old_len += ses->pp - ses->lbeg;
+   if (ses->ms != NULL) pi[0].at[0] = ses->ms - ses->fp;
+   if (ses->ml != NULL) pi[0].at[1] = ses->ml - ses->fp;
+   if (ses->ms_back != NULL) pi[0].at[2] = ses->ms_back - ses->lbeg;
+   if (ses->ml_back != NULL) pi[0].at[3] = ses->ml_back - ses->lbeg;
+   if ((pi[0].at[0] >= pi[0].to - ses->fp) || (pi[0].at[1] >= pi[0].to - ses->fp)) fine = FALSE;   /* a later piece would need it */
+   for (i = 0; i < made; i++) pi[i].room = (unsigned long)(pi[i].old_len + spare / made + 1);
+
+   ended = made;
+   for (i = 0; fine && (i < made); i++) {
+      if (pthread_create (&thread[i], NULL, lines_worker, &pi[i]) != 0) break;
+   }
+   while (--i >= 0) (void)pthread_join (thread[i], NULL);
+
+   /* The loop ends in piece k.  Those before it must all have come
+      round at their ends, with nothing that the next might have seen:
+      an S or backward find after a K could otherwise have looked at
+      ms_back from the line before. */
+   count = 0L;
+   for (k = 0; fine && (k < made); k++) {
+      if (pi[k].outcome == PIECE_FAILED) fine = FALSE;
+      else count += pi[k].count;
+      if (pi[k].outcome != PIECE_SEAM) break;
+      if (pi[k].dirty) fine = FALSE;
+   }
+   if (k >= made) fine = FALSE;
+   if (count <= ses->stopper) fine = FALSE;   /* the units would have stopped it */
+   need = grow = 0L;
+   for (i = 0; fine && (i <= k); i++) {
+      grow += (pi[i].lo_end - pi[i].lo) + (pi[i].hi_end - pi[i].hi) - pi[i].old_len;
+      if (grow > need) need = grow;
+   }
+   if (fine && !make_room ((unsigned long)need)) fine = FALSE;
+
+   if (fine) {
+      line = ses->line_no;
+      n1 = 0L;
+      ses->pp = ses->lbeg;
+      for (i = 0; i <= k; i++) {
+         ses->fp += pi[i].to - pi[i].from;
+         n1 = pi[i].lo_end - pi[i].lo;
+         n2 = pi[i].hi_end - pi[i].hi;
+         (void)memcpy (ses->pp, pi[i].lo, n1 * sizeof(ecce_char));
+         ses->pp += n1;
+         if (i < k) {
+            (void)memcpy (ses->pp, pi[i].hi, n2 * sizeof(ecce_char));
+            ses->pp += n2;
+            line += pi[i].lines_after;
+         } else {
+            ses->fp -= n2;
+            (void)memcpy (ses->fp, pi[i].hi, n2 * sizeof(ecce_char));
+            line += pi[i].line_at;
+         }
+         ses->line_count += pi[i].lines_after - pi[i].lines_before;
       }
+      ses->line_no = line;
+      ses->lbeg = line_start (ses->pp);
+      ses->lend = line_end (ses->fp);
+      ses->ms = (pi[k].at[0] < 0L) ? NULL : ses->fp + pi[k].at[0];
+      ses->ml = (pi[k].at[1] < 0L) ? NULL : ses->fp + pi[k].at[1];
+      ses->ms_back = (pi[k].at[2] < 0L) ? NULL : ses->pp - n1 + pi[k].at[2];
+      ses->ml_back = (pi[k].at[3] < 0L) ? NULL : ses->pp - n1 + pi[k].at[3];
+      ses->pp_before = ses->fp_before = NULL;
+      ses->num[close] = count;
+      ses->this_unit = close;
+      ses->ok = TRUE;
    }
 
-   return (ok = FALSE);
+   for (i = 0; i < made; i++) free (pi[i].buffer);
+   free_program (&prog);
+   free (pi);
+   free (thread);
+   return fine;
+#else
+   return FALSE;
+#endif
 }